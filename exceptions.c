@@ -20,86 +20,1275 @@
  * SOFTWARE.
  */
 
+// Always build the out of line copies of the functions in exceptions_inline.h
+#undef EXCEPTIONS_INLINE
+
 #include "exceptions.h"
+#include "exceptions_inline.h"
 
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// All of the exception state is per thread so that TRY / THROW can be used
+// from any number of threads at once without any locking. Everything except
+// for the statistics and the trace lives in an ExceptionContext, and each
+// thread has its own one, which coroutines can swap for one of theirs. The
+// thread's own one is allocated the first time it is needed, so that threads
+// which never use TRY don't pay for it, and all of the thread locals start out
+// as zero.
+static _Thread_local ExceptionContext *threadContext = NULL;
+_Thread_local ExceptionContext *exceptionContext__ = NULL;
+
+#define ARENA_ALIGNMENT __BIGGEST_ALIGNMENT__
+
+// Each thread's statistics are linked into liveStats the first time it enters
+// a TRY, and added to retiredStats when it exits
+_Thread_local ThreadStats__ threadStats__;
+static ThreadStats__ *liveStats = NULL;
+static ThreadStats__ retiredStats;
+#ifndef EXCEPTIONS_NO_SOURCE_INFO
+static TrySite__ *statsSites[MAX_TRY_SITES];
+static int statsSiteCount = 1;
+#endif
+static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// How many events each thread's trace ring holds, which must be a power of 2
+#ifndef EXCEPTION_TRACE_EVENTS
+#define EXCEPTION_TRACE_EVENTS 1024
+#endif
+
+typedef struct TraceRing
+{
+    struct TraceRing *next;
+    uint32_t threadIndex;
+    // The total number of events written, so the next one goes at
+    // head % EXCEPTION_TRACE_EVENTS
+    uint32_t head;
+    ExceptionTraceEvent events[EXCEPTION_TRACE_EVENTS];
+} TraceRing;
+
+// Each thread's ring is allocated the first time it records an event, and is
+// linked into traceRings (under statsMutex) until the thread exits
+int exceptionTracing__ = 0;
+static _Thread_local TraceRing *traceRing = NULL;
+static TraceRing *traceRings = NULL;
+static uint32_t traceThreadCount = 0;
+
+static void
+freeTraceRing(void)
+{
+    if (!traceRing)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&statsMutex);
+    for (TraceRing **ring = &traceRings; *ring; ring = &(*ring)->next)
+    {
+        if (*ring == traceRing)
+        {
+            *ring = traceRing->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&statsMutex);
+
+    free(traceRing);
+    traceRing = NULL;
+}
+
+static bool backtracesEnabled = false;
+static pthread_once_t backtraceOnce = PTHREAD_ONCE_INIT;
 
-#ifndef MAX_TRY_DEPTH
-#define MAX_TRY_DEPTH 128
+#if EXCEPTIONS_BACKEND == EXCEPTIONS_BACKEND_MINIMAL
+// Only the registers which the ABI requires to be preserved across a call are
+// saved, since TRY is (as far as the compiler is concerned) a function call
+// which can return twice.
+#if defined(__x86_64__)
+// rbx, rbp, r12 - r15, then the caller's stack pointer and return address
+__asm__(".text\n"
+        ".globl exceptionSetjmp__\n"
+        ".type exceptionSetjmp__, @function\n"
+        "exceptionSetjmp__:\n"
+        "    movq %rbx, 0(%rdi)\n"
+        "    movq %rbp, 8(%rdi)\n"
+        "    movq %r12, 16(%rdi)\n"
+        "    movq %r13, 24(%rdi)\n"
+        "    movq %r14, 32(%rdi)\n"
+        "    movq %r15, 40(%rdi)\n"
+        "    leaq 8(%rsp), %rdx\n"
+        "    movq %rdx, 48(%rdi)\n"
+        "    movq (%rsp), %rdx\n"
+        "    movq %rdx, 56(%rdi)\n"
+        "    xorl %eax, %eax\n"
+        "    ret\n"
+        ".size exceptionSetjmp__, .-exceptionSetjmp__\n"
+        ".globl exceptionLongjmp__\n"
+        ".type exceptionLongjmp__, @function\n"
+        "exceptionLongjmp__:\n"
+        "    movl %esi, %eax\n"
+        "    testl %eax, %eax\n"
+        "    jnz 1f\n"
+        "    incl %eax\n"
+        "1:  movq 0(%rdi), %rbx\n"
+        "    movq 8(%rdi), %rbp\n"
+        "    movq 16(%rdi), %r12\n"
+        "    movq 24(%rdi), %r13\n"
+        "    movq 32(%rdi), %r14\n"
+        "    movq 40(%rdi), %r15\n"
+        "    movq 48(%rdi), %rsp\n"
+        "    jmpq *56(%rdi)\n"
+        ".size exceptionLongjmp__, .-exceptionLongjmp__\n");
+#elif defined(__aarch64__)
+// x19 - x28, the frame pointer, link register, stack pointer and d8 - d15
+__asm__(".text\n"
+        ".globl exceptionSetjmp__\n"
+        ".type exceptionSetjmp__, %function\n"
+        "exceptionSetjmp__:\n"
+        "    stp x19, x20, [x0, #0]\n"
+        "    stp x21, x22, [x0, #16]\n"
+        "    stp x23, x24, [x0, #32]\n"
+        "    stp x25, x26, [x0, #48]\n"
+        "    stp x27, x28, [x0, #64]\n"
+        "    stp x29, x30, [x0, #80]\n"
+        "    mov x2, sp\n"
+        "    str x2, [x0, #96]\n"
+        "    stp d8, d9, [x0, #104]\n"
+        "    stp d10, d11, [x0, #120]\n"
+        "    stp d12, d13, [x0, #136]\n"
+        "    stp d14, d15, [x0, #152]\n"
+        "    mov w0, #0\n"
+        "    ret\n"
+        ".size exceptionSetjmp__, .-exceptionSetjmp__\n"
+        ".globl exceptionLongjmp__\n"
+        ".type exceptionLongjmp__, %function\n"
+        "exceptionLongjmp__:\n"
+        "    ldp x19, x20, [x0, #0]\n"
+        "    ldp x21, x22, [x0, #16]\n"
+        "    ldp x23, x24, [x0, #32]\n"
+        "    ldp x25, x26, [x0, #48]\n"
+        "    ldp x27, x28, [x0, #64]\n"
+        "    ldp x29, x30, [x0, #80]\n"
+        "    ldr x2, [x0, #96]\n"
+        "    mov sp, x2\n"
+        "    ldp d8, d9, [x0, #104]\n"
+        "    ldp d10, d11, [x0, #120]\n"
+        "    ldp d12, d13, [x0, #136]\n"
+        "    ldp d14, d15, [x0, #152]\n"
+        "    cmp w1, #0\n"
+        "    csinc w0, w1, wzr, ne\n"
+        "    ret\n"
+        ".size exceptionLongjmp__, .-exceptionLongjmp__\n");
 #endif
+#endif
+
+static pthread_once_t threadKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t threadKey;
 
-jmp_buf exceptionStack__[MAX_TRY_DEPTH];
-static const char *fileNames[MAX_TRY_DEPTH];
-static int lineNumbers[MAX_TRY_DEPTH];
+static void
+addStats(ThreadStats__ *total, const ThreadStats__ *stats)
+{
+    for (int i = 0; i < MAX_TRY_SITES; i++)
+    {
+        total->tryEntries[i] +=
+            __atomic_load_n(&stats->tryEntries[i], __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i <= MAX_EXCEPTION_TYPES; i++)
+    {
+        total->thrown[i] += __atomic_load_n(&stats->thrown[i], __ATOMIC_RELAXED);
+        total->caught[i] += __atomic_load_n(&stats->caught[i], __ATOMIC_RELAXED);
+    }
+    total->rethrown += __atomic_load_n(&stats->rethrown, __ATOMIC_RELAXED);
+    total->unhandled += __atomic_load_n(&stats->unhandled, __ATOMIC_RELAXED);
+
+    unsigned maxDepth = __atomic_load_n(&stats->maxDepth, __ATOMIC_RELAXED);
+    if (maxDepth > total->maxDepth)
+    {
+        total->maxDepth = maxDepth;
+    }
+}
 
-static int exceptionStackDepth = 0;
+// Set once enableSignalExceptions has been called, after which every thread
+// gets an alternate signal stack on its first TRY
+static int signalExceptionsEnabled = 0;
+static _Thread_local stack_t signalStack;
 
-static struct
+static const struct
 {
+    int signal;
     int type;
     const char *message;
-    bool handled;
-} currentException = {
-    .handled = true,
+} signalExceptions[] = {
+    {SIGSEGV, SEGMENTATION_FAULT_EXCEPTION, "Segmentation fault"},
+    {SIGFPE, FLOATING_POINT_EXCEPTION, "Floating point exception"},
+    {SIGBUS, BUS_ERROR_EXCEPTION, "Bus error"},
 };
 
-int try__(const char *fileName, int lineNumber)
+#define NUM_SIGNAL_EXCEPTIONS \
+    (sizeof(signalExceptions) / sizeof(signalExceptions[0]))
+
+static void
+signalHandler(int signal, siginfo_t *info, void *context)
 {
-    fileNames[exceptionStackDepth] = fileName;
-    lineNumbers[exceptionStackDepth] = lineNumber;
-    return exceptionStackDepth++;
+    (void)info;
+    (void)context;
+
+    if (currentContext__()->depth == 0)
+    {
+        // Nothing can catch it, so put back the default action. The faulting
+        // instruction runs again when this returns, or if the signal was
+        // sent rather than caused, it is still pending until then.
+        struct sigaction action = {.sa_handler = SIG_DFL};
+        sigaction(signal, &action, NULL);
+        raise(signal);
+        return;
+    }
+
+    // The signal is blocked while its handler runs, and jumping out of the
+    // handler doesn't unblock it
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, signal);
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+    for (size_t i = 0; i < NUM_SIGNAL_EXCEPTIONS; i++)
+    {
+        if (signalExceptions[i].signal == signal)
+        {
+            throw__(signalExceptions[i].type, signalExceptions[i].message);
+        }
+    }
 }
 
-void throw__(int type, const char *message)
+static int
+installSignalStack(void)
+{
+    if (signalStack.ss_sp)
+    {
+        return 0;
+    }
+
+    // Big enough for the handler plus throw__ and anything it calls
+    size_t size = SIGSTKSZ < 65536 ? 65536 : SIGSTKSZ;
+    stack_t stack = {.ss_sp = malloc(size), .ss_size = size};
+    if (!stack.ss_sp)
+    {
+        return -1;
+    }
+    if (sigaltstack(&stack, NULL) != 0)
+    {
+        free(stack.ss_sp);
+        return -1;
+    }
+
+    signalStack = stack;
+    return 0;
+}
+
+static void
+freeSignalStack(void)
+{
+    if (!signalStack.ss_sp)
+    {
+        return;
+    }
+
+    stack_t disable = {.ss_flags = SS_DISABLE};
+    sigaltstack(&disable, NULL);
+    free(signalStack.ss_sp);
+    signalStack.ss_sp = NULL;
+}
+
+int enableSignalExceptions(void)
+{
+    if (installSignalStack() != 0)
+    {
+        return -1;
+    }
+
+    struct sigaction action = {
+        .sa_sigaction = signalHandler,
+        .sa_flags = SA_SIGINFO | SA_ONSTACK,
+    };
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < NUM_SIGNAL_EXCEPTIONS; i++)
+    {
+        if (sigaction(signalExceptions[i].signal, &action, NULL) != 0)
+        {
+            return -1;
+        }
+    }
+
+    __atomic_store_n(&signalExceptionsEnabled, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Frees the chunks which were allocated by growStack__
+static void
+freeChunks(ExceptionContext *context)
+{
+    for (int i = 1; i < NUM_TRY_CHUNKS__; i++)
+    {
+        free(context->tryChunks[i]);
+        context->tryChunks[i] = NULL;
+    }
+}
+
+// Runs as each thread which has used TRY exits
+static void
+exitThread(void *context)
+{
+    (void)context;
+    if (exceptionContext__ == threadContext)
+    {
+        exceptionContext__ = NULL;
+    }
+    destroyExceptionContext(threadContext);
+    threadContext = NULL;
+
+    pthread_mutex_lock(&statsMutex);
+    addStats(&retiredStats, &threadStats__);
+    for (ThreadStats__ **stats = &liveStats; *stats; stats = &(*stats)->next)
+    {
+        if (*stats == &threadStats__)
+        {
+            *stats = threadStats__.next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&statsMutex);
+
+    freeTraceRing();
+    freeSignalStack();
+}
+
+static void
+createThreadKey(void)
+{
+    pthread_key_create(&threadKey, exitThread);
+}
+
+// Whether registerThread has run on this thread
+static _Thread_local bool threadRegistered = false;
+
+// The thread's own context, which is created the first time it is asked for
+static ExceptionContext *
+ownContext(void)
+{
+    if (__builtin_expect(!threadContext, 0))
+    {
+        threadContext = createExceptionContext();
+        if (!threadContext)
+        {
+            // There is nowhere to throw from without a context
+            fprintf(stderr, "Failed to allocate an exception context\n");
+            abort();
+        }
+    }
+
+    return threadContext;
+}
+
+// Sets up everything which belongs to the thread rather than to a context
+static void
+registerThread(void)
+{
+    threadRegistered = true;
+    pthread_once(&threadKeyOnce, createThreadKey);
+    // The value only needs to be non NULL for exitThread to run
+    pthread_setspecific(threadKey, ownContext());
+
+    pthread_mutex_lock(&statsMutex);
+    threadStats__.next = liveStats;
+    liveStats = &threadStats__;
+    pthread_mutex_unlock(&statsMutex);
+
+    if (__atomic_load_n(&signalExceptionsEnabled, __ATOMIC_RELAXED))
+    {
+        installSignalStack();
+    }
+}
+
+TryChunk__ *growStack__(ExceptionContext *context, int chunkIndex)
+{
+    if (chunkIndex == 0)
+    {
+        // This is the first TRY in this context
+        if (!threadRegistered)
+        {
+            registerThread();
+        }
+
+        context->tryChunks[0] = &context->firstChunk;
+        return &context->firstChunk;
+    }
+
+    TryChunk__ *chunk;
+    if (posix_memalign((void **)&chunk, CACHE_LINE_SIZE__, sizeof(TryChunk__)))
+    {
+        throw__(CALL_STACK_EXCEEDED_EXCEPTION,
+                "Failed to grow the exception stack");
+    }
+
+    context->tryChunks[chunkIndex] = chunk;
+    return chunk;
+}
+
+ExceptionContext *threadContext__(void)
 {
-    currentException.type = type;
-    currentException.message = message;
-    currentException.handled = false;
-    if (exceptionStackDepth == 0)
+    return exceptionContext__ = ownContext();
+}
+
+ExceptionContext *createExceptionContext(void)
+{
+    ExceptionContext *context;
+    if (posix_memalign((void **)&context, _Alignof(ExceptionContext),
+                       sizeof(ExceptionContext)))
+    {
+        return NULL;
+    }
+
+    // Only the start needs clearing, the arrays after it are written before
+    // they are read
+    memset(context, 0, offsetof(ExceptionContext, deferred));
+    context->currentException.handled = true;
+    context->arenaUsed = 0;
+    return context;
+}
+
+void destroyExceptionContext(ExceptionContext *context)
+{
+    if (!context)
+    {
+        return;
+    }
+
+    freeChunks(context);
+    free(context);
+}
+
+ExceptionContext *swapExceptionContext(ExceptionContext *context)
+{
+    // The context may have been created on (or last used by) another thread
+    if (__builtin_expect(!threadRegistered, 0))
     {
+        registerThread();
+    }
+
+    ExceptionContext *previous = currentContext__();
+    exceptionContext__ = context ? context : ownContext();
+    return previous;
+}
+
+#ifndef EXCEPTIONS_NO_SOURCE_INFO
+int assignStatsSlot__(TrySite__ *site)
+{
+    pthread_mutex_lock(&statsMutex);
+    int slot = site->statsSlot;
+    if (slot < 0)
+    {
+        slot = 0;
+        if (statsSiteCount < MAX_TRY_SITES)
+        {
+            slot = statsSiteCount++;
+            statsSites[slot] = site;
+        }
+        __atomic_store_n(&site->statsSlot, slot, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&statsMutex);
+
+    return slot;
+}
+#endif
+
+void getExceptionStats(ExceptionStats *stats)
+{
+    static ThreadStats__ total;
+
+    pthread_mutex_lock(&statsMutex);
+    total = retiredStats;
+    for (ThreadStats__ *live = liveStats; live; live = live->next)
+    {
+        addStats(&total, live);
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    memcpy(stats->thrown, total.thrown, sizeof(stats->thrown));
+    memcpy(stats->caught, total.caught, sizeof(stats->caught));
+    stats->rethrown = total.rethrown;
+    stats->unhandled = total.unhandled;
+    stats->maxDepth = total.maxDepth;
+
+#ifdef EXCEPTIONS_NO_SOURCE_INFO
+    stats->siteCount = 1;
+#else
+    stats->siteCount = statsSiteCount;
+    for (int i = 1; i < statsSiteCount; i++)
+    {
+        stats->sites[i].fileName = statsSites[i]->fileName;
+        stats->sites[i].lineNumber = statsSites[i]->lineNumber;
+    }
+#endif
+    for (int i = 0; i < stats->siteCount; i++)
+    {
+        stats->sites[i].entries = total.tryEntries[i];
+    }
+    pthread_mutex_unlock(&statsMutex);
+}
+
+// Returns the number of bytes left in the arena after aligning it for any type
+static size_t
+arenaSpace(ExceptionContext *context)
+{
+    context->arenaUsed = (context->arenaUsed + ARENA_ALIGNMENT - 1) &
+                         ~(size_t)(ARENA_ALIGNMENT - 1);
+    if (context->arenaUsed >= EXCEPTION_ARENA_SIZE)
+    {
+        context->arenaUsed = EXCEPTION_ARENA_SIZE;
+    }
+
+    return EXCEPTION_ARENA_SIZE - context->arenaUsed;
+}
+
+static void *
+arenaAllocate(size_t size)
+{
+    ExceptionContext *context = currentContext__();
+    if (arenaSpace(context) < size)
+    {
+        return NULL;
+    }
+
+    void *allocation = context->arena + context->arenaUsed;
+    context->arenaUsed += size;
+    return allocation;
+}
+
+// The first call to backtrace loads the unwinder, which allocates, so get
+// that out of the way before it is needed on the throw path
+static void
+primeBacktrace(void)
+{
+    void *frame;
+    backtrace(&frame, 1);
+}
+
+void setExceptionBacktraces(int enable)
+{
+    if (enable)
+    {
+        pthread_once(&backtraceOnce, primeBacktrace);
+    }
+    __atomic_store_n(&backtracesEnabled, enable != 0, __ATOMIC_RELAXED);
+}
+
+// Records the return addresses above the throw function which called this
+__attribute__((noinline)) static void
+captureBacktrace(void)
+{
+    ExceptionContext *context = currentContext__();
+    context->currentException.backtraceLength = 0;
+    if (!__atomic_load_n(&backtracesEnabled, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    int length = backtrace(context->backtrace,
+                           EXCEPTION_BACKTRACE_DEPTH + BACKTRACE_SKIP__);
+    // Start after the frame returning into the throw function, which isn't
+    // always at BACKTRACE_SKIP__ - 1, since sanitizers wrap backtrace in a
+    // frame of their own
+    void *throwFunction = __builtin_return_address(0);
+    int skip = BACKTRACE_SKIP__;
+    for (int i = 0; i < length; i++)
+    {
+        if (context->backtrace[i] == throwFunction)
+        {
+            skip = i + 1;
+            break;
+        }
+    }
+
+    // Point into the call instruction rather than just after it, since a
+    // call to a noreturn throw can be the last thing in a function and the
+    // return address would then name whatever function comes next
+    for (int i = skip; i < length; i++)
+    {
+        context->backtrace[i] = (char *)context->backtrace[i] - 1;
+    }
+    context->currentException.backtrace = context->backtrace + skip;
+    context->currentException.backtraceLength =
+        length > skip ? length - skip : 0;
+}
+
+void printExceptionBacktrace(const Exception *e, int fd)
+{
+    // Unlike backtrace_symbols, this doesn't allocate
+    backtrace_symbols_fd(e->backtrace, e->backtraceLength, fd);
+}
+
+void runDeferred__(int depth)
+{
+    // A cleanup could use TRY itself, so keep hold of the exception which
+    // might be in flight
+    ExceptionContext *context = currentContext__();
+    CurrentException__ exception = context->currentException;
+
+    while (context->deferredCount > 0 &&
+           context->deferred[context->deferredCount - 1].depth >= depth)
+    {
+        // Pop it first, so it isn't run again if it throws
+        DeferredCleanup__ cleanup = context->deferred[--context->deferredCount];
+        cleanup.fn(cleanup.arg);
+    }
+
+    context->currentException = exception;
+}
+
+void deferOverflow__(void (*fn)(void *), void *arg)
+{
+    // There is nowhere to keep it, so don't leak whatever it cleans up
+    fn(arg);
+    throw__(CALL_STACK_EXCEEDED_EXCEPTION, "Too many DEFERs");
+}
+
+// Jumps to the nearest TRY block with whatever is the current exception
+static noreturn void
+throwCurrent(void)
+{
+    ExceptionContext *context = currentContext__();
+    CurrentException__ *exception = &context->currentException;
+    runDeferred__(context->depth);
+
+    exception->handled = false;
+    if (context->depth == 0)
+    {
+        STATS_ADD__(threadStats__.unhandled);
         fprintf(stderr, "Unhandled exception of type %i with messasge %s\n",
-                type, message);
+                exception->type, catchMessage__());
+        if (exception->backtraceLength > 0)
+        {
+            backtrace_symbols_fd(exception->backtrace,
+                                 exception->backtraceLength, STDERR_FILENO);
+        }
         exit(1);
     }
-    longjmp(exceptionStack__[exceptionStackDepth - 1], type);
+    EXCEPTION_LONGJMP__(frameAt__(context, context->depth - 1)->buffer,
+                        exception->type);
+}
+
+void throw__(int type, const char *message)
+{
+    captureBacktrace();
+    STATS_ADD__(threadStats__.thrown[statsTypeSlot__(type)]);
+    CurrentException__ *exception = &currentContext__()->currentException;
+    exception->type = type;
+    exception->message = message;
+    exception->payload = NULL;
+    exception->payloadSize = 0;
+    exception->format = NULL;
+    if (TRACING__())
+    {
+        traceEvent__(EXCEPTION_TRACE_THROW);
+    }
+    throwCurrent();
+}
+
+void throwPayload__(int type, const char *message, const void *payload,
+                    size_t payloadSize)
+{
+    captureBacktrace();
+    STATS_ADD__(threadStats__.thrown[statsTypeSlot__(type)]);
+    void *copy = arenaAllocate(payloadSize);
+    if (copy)
+    {
+        memcpy(copy, payload, payloadSize);
+    }
+
+    CurrentException__ *exception = &currentContext__()->currentException;
+    exception->type = type;
+    exception->message = message;
+    exception->payload = copy;
+    exception->payloadSize = copy ? payloadSize : 0;
+    exception->format = NULL;
+    if (TRACING__())
+    {
+        traceEvent__(EXCEPTION_TRACE_THROW);
+    }
+    throwCurrent();
+}
+
+// Copies a THROWF string argument, since it may be on the stack which is
+// about to be unwound
+static const char *
+copyString(const char *string)
+{
+    if (!string)
+    {
+        return NULL;
+    }
+
+    size_t length = strlen(string) + 1;
+    char *copy = arenaAllocate(length);
+    if (!copy)
+    {
+        return "<truncated>";
+    }
+
+    return memcpy(copy, string, length);
 }
 
+void throwf__(int type, const char *format, int argCount,
+              const ExceptionArg__ *args)
+{
+    ExceptionArg__ *copy = arenaAllocate(argCount * sizeof(ExceptionArg__));
+    if (!copy)
+    {
+        throw__(type, format);
+    }
+
+    captureBacktrace();
+    STATS_ADD__(threadStats__.thrown[statsTypeSlot__(type)]);
+
+    for (int i = 0; i < argCount; i++)
+    {
+        copy[i] = args[i];
+        if (args[i].kind == EXCEPTION_ARG_STRING__)
+        {
+            copy[i].value.s = copyString(args[i].value.s);
+        }
+    }
+
+    CurrentException__ *exception = &currentContext__()->currentException;
+    exception->type = type;
+    exception->message = NULL;
+    exception->payload = NULL;
+    exception->payloadSize = 0;
+    exception->format = format;
+    exception->args = copy;
+    exception->argCount = argCount;
+    if (TRACING__())
+    {
+        traceEvent__(EXCEPTION_TRACE_THROW);
+    }
+    throwCurrent();
+}
+
+static long long
+argAsInt(const ExceptionArg__ *arg)
+{
+    switch (arg->kind)
+    {
+    case EXCEPTION_ARG_INT__:
+        return arg->value.i;
+    case EXCEPTION_ARG_UNSIGNED__:
+        return (long long)arg->value.u;
+    case EXCEPTION_ARG_DOUBLE__:
+        return (long long)arg->value.d;
+    default:
+        return (long long)(size_t)arg->value.p;
+    }
+}
+
+static double
+argAsDouble(const ExceptionArg__ *arg)
+{
+    switch (arg->kind)
+    {
+    case EXCEPTION_ARG_DOUBLE__:
+        return arg->value.d;
+    case EXCEPTION_ARG_UNSIGNED__:
+        return (double)arg->value.u;
+    default:
+        return (double)argAsInt(arg);
+    }
+}
+
+// The room formatArg needs after a conversion spec for the ll modifier, the
+// conversion character and the NUL
+#define SPEC_SUFFIX_LENGTH 4
+
+// Appends one conversion to the message. spec is the conversion without its
+// length modifier or conversion character, which are added here based on what
+// the conversion expects.
+static int
+formatArg(char *buffer, size_t space, char *spec, size_t specLength,
+          char conversion, const ExceptionArg__ *arg)
+{
+    static const ExceptionArg__ missing = {EXCEPTION_ARG_POINTER__, {.p = 0}};
+    if (!arg)
+    {
+        arg = &missing;
+    }
+
+    switch (conversion)
+    {
+    case 'd':
+    case 'i':
+        strcpy(spec + specLength, "ll");
+        spec[specLength + 2] = conversion;
+        spec[specLength + 3] = '\0';
+        return snprintf(buffer, space, spec, argAsInt(arg));
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+        strcpy(spec + specLength, "ll");
+        spec[specLength + 2] = conversion;
+        spec[specLength + 3] = '\0';
+        return snprintf(buffer, space, spec,
+                        arg->kind == EXCEPTION_ARG_UNSIGNED__
+                            ? arg->value.u
+                            : (unsigned long long)argAsInt(arg));
+    case 'c':
+        spec[specLength] = conversion;
+        spec[specLength + 1] = '\0';
+        return snprintf(buffer, space, spec, (int)argAsInt(arg));
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        spec[specLength] = conversion;
+        spec[specLength + 1] = '\0';
+        return snprintf(buffer, space, spec, argAsDouble(arg));
+    case 's':
+        spec[specLength] = conversion;
+        spec[specLength + 1] = '\0';
+        return snprintf(buffer, space, spec,
+                        arg->kind == EXCEPTION_ARG_STRING__ && arg->value.s
+                            ? arg->value.s
+                            : "(null)");
+    default:
+        spec[specLength] = 'p';
+        spec[specLength + 1] = '\0';
+        return snprintf(buffer, space, spec, arg->value.p);
+    }
+}
+
+// Formats a THROWF message into the arena from the captured arguments
+const char *
+formatMessage__(void)
+{
+    ExceptionContext *context = currentContext__();
+    CurrentException__ *exception = &context->currentException;
+    const char *format = exception->format;
+    const ExceptionArg__ *args = exception->args;
+    int argCount = exception->argCount;
+    exception->format = NULL;
+
+    size_t space = arenaSpace(context);
+    if (space == 0)
+    {
+        return exception->message = format;
+    }
+
+    char *buffer = context->arena + context->arenaUsed;
+    size_t length = 0;
+    int nextArg = 0;
+
+    for (const char *c = format; *c;)
+    {
+        int written;
+        if (*c != '%' || c[1] == '%')
+        {
+            written = 1;
+            if (length < space)
+            {
+                buffer[length] = *c;
+            }
+            c += *c == '%' ? 2 : 1;
+        }
+        else
+        {
+            // Rebuild the conversion, replacing * with the next argument.
+            // Anything which doesn't fit is dropped, always leaving room for
+            // formatArg to finish it off.
+            char spec[64] = "%";
+            size_t specLength = 1;
+            const size_t maxSpecLength = sizeof(spec) - SPEC_SUFFIX_LENGTH;
+            for (c++; *c && strchr("-+ #0123456789.*", *c); c++)
+            {
+                if (*c == '*')
+                {
+                    const ExceptionArg__ *arg =
+                        nextArg < argCount ? &args[nextArg++] : NULL;
+                    size_t room = maxSpecLength - specLength;
+                    int printed = snprintf(spec + specLength, room + 1, "%d",
+                                           arg ? (int)argAsInt(arg) : 0);
+                    if (printed > 0)
+                    {
+                        specLength += (size_t)printed < room ? (size_t)printed
+                                                             : room;
+                    }
+                }
+                else if (specLength < maxSpecLength)
+                {
+                    spec[specLength++] = *c;
+                }
+            }
+            while (*c && strchr("hlLqjzt", *c))
+            {
+                c++;
+            }
+            if (!*c)
+            {
+                break;
+            }
+
+            const ExceptionArg__ *arg =
+                nextArg < argCount ? &args[nextArg++] : NULL;
+            written = length < space
+                          ? formatArg(buffer + length, space - length, spec,
+                                      specLength, *c, arg)
+                          : formatArg(NULL, 0, spec, specLength, *c, arg);
+            c++;
+            if (written < 0)
+            {
+                written = 0;
+            }
+        }
+
+        length += written;
+    }
+
+    if (length >= space)
+    {
+        length = space - 1;
+    }
+    buffer[length] = '\0';
+    context->arenaUsed += length + 1;
+
+    return exception->message = buffer;
+}
+
+// Used by RETHROW, so that the exception is passed on once the FINALLY block
+// has run
+void uncatch__(void)
+{
+    STATS_ADD__(threadStats__.rethrown);
+    if (TRACING__())
+    {
+        traceEvent__(EXCEPTION_TRACE_RETHROW);
+    }
+    currentContext__()->currentException.handled = false;
+}
+
+// Called as a TRY moves on to its FINALLY pass. Returns whether there is an
+// exception which wasn't caught, which is then held in the TRY's frame.
+int holdException__(void)
+{
+    ExceptionContext *context = currentContext__();
+    if (context->currentException.handled)
+    {
+        return 0;
+    }
+
+    frameAt__(context, context->depth - 1)->held = context->currentException;
+    return 1;
+}
+
+// Passes the held exception on to the next TRY out
 void rethrow__(void)
 {
+    ExceptionContext *context = currentContext__();
+    context->currentException = frameAt__(context, context->depth - 1)->held;
+    // Keep the exception's part of the arena for the TRY which catches it
+    size_t arenaUsed = context->arenaUsed;
     endTry__();
-    throw__(currentException.type, currentException.message);
+    context->arenaUsed = arenaUsed;
+    throwCurrent();
 }
 
-const char *
-catchMessage__(void)
+Exception catchException__(void)
+{
+    const CurrentException__ *exception = &currentContext__()->currentException;
+    return (Exception){
+        .type = exception->type,
+        .message = catchMessage__(),
+        .payload = exception->payload,
+        .payloadSize = exception->payloadSize,
+        .backtrace = exception->backtrace,
+        .backtraceLength = exception->backtraceLength,
+    };
+}
+
+// The exception type hierarchy is shared by all threads. A parent of 0 means
+// the type isn't registered, and a parent of itself means it is a root.
+ExceptionTypeRange__ exceptionTypeRanges__[MAX_EXCEPTION_TYPES];
+static int exceptionTypeParents[MAX_EXCEPTION_TYPES];
+static pthread_mutex_t exceptionTypesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Numbers type and its descendants in depth first order, returning the next
+// free number
+static int
+numberExceptionTypes(int type, int next)
+{
+    exceptionTypeRanges__[type].enter = next++;
+    for (int child = 1; child < MAX_EXCEPTION_TYPES; child++)
+    {
+        if (child != type && exceptionTypeParents[child] == type)
+        {
+            next = numberExceptionTypes(child, next);
+        }
+    }
+    exceptionTypeRanges__[type].exit = next;
+
+    return next;
+}
+
+int registerExceptionType(int type, int parent)
+{
+    if (type <= 0 || type >= MAX_EXCEPTION_TYPES || parent < 0 ||
+        parent >= MAX_EXCEPTION_TYPES || type == parent)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&exceptionTypesMutex);
+
+    int wantedParent = parent ? parent : type;
+    int result = 0;
+    if (parent && !exceptionTypeParents[parent])
+    {
+        result = -1;
+    }
+    else if (exceptionTypeParents[type])
+    {
+        result = exceptionTypeParents[type] == wantedParent ? 0 : -1;
+    }
+    else
+    {
+        // Since type isn't registered yet, it has no descendants and so
+        // there is no way of creating a cycle
+        exceptionTypeParents[type] = wantedParent;
+
+        // Start from 1 so that unregistered types (with 0) never match
+        int next = 1;
+        for (int root = 1; root < MAX_EXCEPTION_TYPES; root++)
+        {
+            if (exceptionTypeParents[root] == root)
+            {
+                next = numberExceptionTypes(root, next);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&exceptionTypesMutex);
+    return result;
+}
+
+static uint64_t
+readTicks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static uint64_t
+readNanoseconds(void)
 {
-    return currentException.message;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
-int catchHandled__(void)
+// When tracing was turned on, to work out how fast readTicks ticks
+static uint64_t traceStartTicks;
+static uint64_t traceStartNanoseconds;
+
+void setExceptionTracing(int enable)
 {
-    bool oldWasCatchHandled = currentException.handled;
-    currentException.handled = true;
+    if (enable)
+    {
+        pthread_mutex_lock(&statsMutex);
+        traceStartTicks = readTicks();
+        traceStartNanoseconds = readNanoseconds();
+        pthread_mutex_unlock(&statsMutex);
+    }
+    __atomic_store_n(&exceptionTracing__, enable != 0, __ATOMIC_RELAXED);
+}
+
+void traceEvent__(int kind)
+{
+    TraceRing *ring = traceRing;
+    if (__builtin_expect(!ring, 0))
+    {
+        ring = calloc(1, sizeof(TraceRing));
+        if (!ring)
+        {
+            return;
+        }
+
+        pthread_mutex_lock(&statsMutex);
+        ring->threadIndex = traceThreadCount++;
+        ring->next = traceRings;
+        traceRings = ring;
+        pthread_mutex_unlock(&statsMutex);
+        traceRing = ring;
+    }
+
+    ExceptionContext *context = currentContext__();
+    int depth = context->depth;
+    int site = 0;
+#ifndef EXCEPTIONS_NO_SOURCE_INFO
+    // try__ only assigns slots when it is counting entries
+    if (depth > 0)
+    {
+        TrySite__ *trySite = frameAt__(context, depth - 1)->site;
+        site = __atomic_load_n(&trySite->statsSlot, __ATOMIC_RELAXED);
+        if (site < 0)
+        {
+            site = assignStatsSlot__(trySite);
+        }
+    }
+#endif
 
-    return oldWasCatchHandled;
+    uint32_t head = ring->head;
+    ring->events[head % EXCEPTION_TRACE_EVENTS] = (ExceptionTraceEvent){
+        .timestamp = readTicks(),
+        .type = kind == EXCEPTION_TRACE_FINALLY ? 0
+                                                : context->currentException.type,
+        .site = site,
+        .depthAndKind = depth << 3 | kind,
+    };
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
 }
 
-void endTry__(void)
+static int
+writeAll(int fd, const void *buffer, size_t length)
 {
-    exceptionStackDepth--;
+    const char *remaining = buffer;
+    while (length > 0)
+    {
+        ssize_t written = write(fd, remaining, length);
+        if (written < 0)
+        {
+            return -1;
+        }
+        remaining += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+static uint64_t
+ticksPerSecond(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    // Make sure there is at least a millisecond to measure the TSC over
+    while (readNanoseconds() - traceStartNanoseconds < 1000000)
+    {
+    }
+
+    uint64_t ticks = readTicks() - traceStartTicks;
+    uint64_t nanoseconds = readNanoseconds() - traceStartNanoseconds;
+    return (uint64_t)((double)ticks * 1e9 / nanoseconds);
+#else
+    return 1000000000ull;
+#endif
+}
+
+int dumpExceptionTrace(int fd)
+{
+    pthread_mutex_lock(&statsMutex);
+
+    ExceptionTraceHeader header = {
+        .ticksPerSecond = ticksPerSecond(),
+#ifdef EXCEPTIONS_NO_SOURCE_INFO
+        .siteCount = 1,
+#else
+        .siteCount = statsSiteCount,
+#endif
+    };
+    memcpy(header.magic, EXCEPTION_TRACE_MAGIC, sizeof(header.magic));
+    for (TraceRing *ring = traceRings; ring; ring = ring->next)
+    {
+        header.threadCount++;
+    }
+
+    int result = writeAll(fd, &header, sizeof(header));
+    for (uint32_t i = 0; i < header.siteCount && result == 0; i++)
+    {
+        ExceptionTraceSite site = {0};
+#ifndef EXCEPTIONS_NO_SOURCE_INFO
+        if (i > 0)
+        {
+            site.lineNumber = statsSites[i]->lineNumber;
+            strncpy(site.fileName, statsSites[i]->fileName,
+                    sizeof(site.fileName) - 1);
+        }
+#endif
+        result = writeAll(fd, &site, sizeof(site));
+    }
+
+    for (TraceRing *ring = traceRings; ring && result == 0; ring = ring->next)
+    {
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t count =
+            head < EXCEPTION_TRACE_EVENTS ? head : EXCEPTION_TRACE_EVENTS;
+        ExceptionTraceThread thread = {ring->threadIndex, count};
+        result = writeAll(fd, &thread, sizeof(thread));
+
+        // The oldest events are the ones just after head in the ring
+        uint32_t start = (head - count) % EXCEPTION_TRACE_EVENTS;
+        uint32_t firstPart = EXCEPTION_TRACE_EVENTS - start;
+        if (firstPart > count)
+        {
+            firstPart = count;
+        }
+        if (result == 0)
+        {
+            result = writeAll(fd, &ring->events[start],
+                              firstPart * sizeof(ExceptionTraceEvent));
+        }
+        if (result == 0)
+        {
+            result = writeAll(fd, &ring->events[0],
+                              (count - firstPart) * sizeof(ExceptionTraceEvent));
+        }
+    }
+
+    pthread_mutex_unlock(&statsMutex);
+    return result;
 }
 
 int getExceptionStackDepth__(void);
 // Used in the testing framework to ensure that it is always working
 int getExceptionStackDepth__(void)
 {
+    ExceptionContext *context = currentContext__();
     fprintf(stderr, "Exception stack:\n");
-    for (int i = 0; i < exceptionStackDepth; i++)
+    for (int i = 0; i < context->depth; i++)
     {
-        fprintf(stderr, "%s:%d\n", fileNames[i], lineNumbers[i]);
+#ifdef EXCEPTIONS_NO_SOURCE_INFO
+        fprintf(stderr, "<unknown>\n");
+#else
+        const TrySite__ *site = frameAt__(context, i)->site;
+        fprintf(stderr, "%s:%d\n", site->fileName, site->lineNumber);
+#endif
     }
 
-    return exceptionStackDepth;
+    return context->depth;
 }
@@ -28,9 +28,67 @@
 #pragma once
 
 #include <setjmp.h>
+#include <stddef.h>
 #include <stdnoreturn.h>
 
-extern jmp_buf exceptionStack__[];
+/*
+ * The context save / restore used by TRY and THROW can be selected at compile
+ * time by defining EXCEPTIONS_BACKEND to one of the following. The library and
+ * all code using it must be built with the same backend.
+ *
+ * EXCEPTIONS_BACKEND_SETJMP: the standard setjmp / longjmp (the default).
+ * Depending on the libc, this may save and restore the signal mask which
+ * costs a system call on every TRY.
+ *
+ * EXCEPTIONS_BACKEND_UNDERSCORE: POSIX _setjmp / _longjmp which never touch
+ * the signal mask.
+ *
+ * EXCEPTIONS_BACKEND_MINIMAL: a hand written context save for x86-64 and
+ * AArch64 which only stores the callee saved registers, stack pointer and
+ * resume address. It does not touch the signal mask, mangle pointers or
+ * support CET shadow stacks.
+ */
+#define EXCEPTIONS_BACKEND_SETJMP 0
+#define EXCEPTIONS_BACKEND_UNDERSCORE 1
+#define EXCEPTIONS_BACKEND_MINIMAL 2
+
+#ifndef EXCEPTIONS_BACKEND
+#define EXCEPTIONS_BACKEND EXCEPTIONS_BACKEND_SETJMP
+#endif
+
+/*
+ * The limits MAX_TRY_DEPTH, TRY_CHUNK_SIZE, MAX_DEFERRED, EXCEPTION_ARENA_SIZE,
+ * EXCEPTION_BACKTRACE_DEPTH, MAX_EXCEPTION_TYPES and MAX_TRY_SITES can be
+ * overridden at compile time too, but they set the layout of the per-thread
+ * context, the statistics and the exception type table. Like the backend,
+ * they are ABI settings: the library and all code using it must be built with
+ * the same values, or they will silently disagree about where things are.
+ * The same goes for EXCEPTIONS_NO_SOURCE_INFO and EXCEPTIONS_NO_TRY_STATS.
+ */
+
+#if EXCEPTIONS_BACKEND == EXCEPTIONS_BACKEND_SETJMP
+typedef jmp_buf ExceptionJmpBuf__;
+#define EXCEPTION_SETJMP__(env) setjmp(env)
+#define EXCEPTION_LONGJMP__(env, type) longjmp(env, type)
+#elif EXCEPTIONS_BACKEND == EXCEPTIONS_BACKEND_UNDERSCORE
+typedef jmp_buf ExceptionJmpBuf__;
+#define EXCEPTION_SETJMP__(env) _setjmp(env)
+#define EXCEPTION_LONGJMP__(env, type) _longjmp(env, type)
+#elif EXCEPTIONS_BACKEND == EXCEPTIONS_BACKEND_MINIMAL
+#if defined(__x86_64__)
+typedef void *ExceptionJmpBuf__[8];
+#elif defined(__aarch64__)
+typedef void *ExceptionJmpBuf__[21];
+#else
+#error "EXCEPTIONS_BACKEND_MINIMAL is only available on x86-64 and AArch64"
+#endif
+__attribute__((returns_twice)) int exceptionSetjmp__(ExceptionJmpBuf__ env);
+noreturn void exceptionLongjmp__(ExceptionJmpBuf__ env, int value);
+#define EXCEPTION_SETJMP__(env) exceptionSetjmp__(env)
+#define EXCEPTION_LONGJMP__(env, type) exceptionLongjmp__(env, type)
+#else
+#error "Unknown EXCEPTIONS_BACKEND"
+#endif
 
 /**
  * Holds information about a thrown exception.
@@ -76,12 +134,22 @@ extern jmp_buf exceptionStack__[];
  * }
  * @endcode
  *
- * The code within the FINALLY block will be excuted before returning. This
- * does not work within nested TRY blocks.
+ * The code within the FINALLY block will be excuted before returning. Within
+ * nested TRY blocks, the FINALLY block of every enclosing TRY in the function
+ * runs, innermost first.
  *
- * RETURN also works within CATCH blocks but are not defined within FINALLY
- * blocks and their use within FINALLY blocks will cause the TRY / CATCH state
- * to become corrupt.
+ * RETURN also works within CATCH and FINALLY blocks. A FINALLY block which
+ * uses RETURN isn't run a second time. A RETURN doesn't swallow an exception
+ * though: if the TRY is passing on an exception which it didn't catch, or
+ * which was RETHROWn, a RETURN in its FINALLY block leaves through the
+ * enclosing FINALLY blocks as usual and the exception is then thrown again
+ * instead of the function returning.
+ *
+ * Each thread has its own exception stack, so an exception thrown on one
+ * thread can only ever be caught by a TRY block on that same thread. TRY
+ * blocks can be nested up to MAX_TRY_DEPTH deep (1024 by default), after
+ * which TRY will throw CALL_STACK_EXCEEDED_EXCEPTION. Coroutines which share
+ * a thread need an exception stack each, see swapExceptionContext.
  *
  * See https://gwilym.dev/2020/12/the-c-preprocessor-is-awesome-part-iii/ for implementation details.
  */
@@ -91,14 +159,107 @@ typedef struct
     int type;
     /** The message (i.e. the massage passed to THROW()) */
     const char *message;
+    /** The payload passed to THROW_PAYLOAD(), or NULL if there isn't one */
+    const void *payload;
+    /** The size of the payload in bytes */
+    size_t payloadSize;
+    /**
+     * The call sites which the exception was thrown from, innermost first,
+     * if backtraces are enabled. Each is one byte before the return address
+     * so that it falls within the calling function. Only valid until the
+     * next exception is thrown on this thread.
+     */
+    void *const *backtrace;
+    /** The number of addresses in backtrace */
+    int backtraceLength;
 } Exception;
 
-int try__(const char *filename, int lineNumber);
-int catchHandled__(void);
-const char *catchMessage__(void);
+/**
+ * Turn recording where exceptions are thrown from on or off for all threads
+ * (it starts off). The trace is only the raw return addresses, so recording
+ * it doesn't allocate, and it is only turned into function names by
+ * printExceptionBacktrace or when an exception isn't caught.
+ *
+ * @param enable Whether to record backtraces
+ */
+void setExceptionBacktraces(int enable);
+
+/**
+ * Write the backtrace of the exception e (from CATCH_ALL(e)) to the file
+ * descriptor fd, one frame per line. Function names are only available for
+ * code linked with -rdynamic.
+ *
+ * @param e The exception
+ * @param fd Where to write it, e.g. STDERR_FILENO
+ */
+void printExceptionBacktrace(const Exception *e, int fd);
+
+#ifdef EXCEPTIONS_NO_SOURCE_INFO
+/*
+ * Defining EXCEPTIONS_NO_SOURCE_INFO (for the library and all code using it)
+ * stops TRY from recording where it is in the source code, so entering a TRY
+ * is just the stack push, the setjmp and the statistics counters. Define
+ * EXCEPTIONS_NO_TRY_STATS as well to leave out the counters too.
+ */
+#define TRY_SITE__
+
+#else
+/**
+ * Where a TRY block is in the source code. Each TRY has a single static
+ * instance of this, so the location can be passed around as one pointer.
+ * statsSlot is the site's entry in the TRY statistics, or -1 until the TRY
+ * is first entered.
+ */
+typedef struct
+{
+    const char *fileName;
+    int lineNumber;
+    int statsSlot;
+} TrySite__;
+
+#define TRY_SITE__                                               \
+    ({                                                           \
+        static TrySite__ trySite__ = {__FILE__, __LINE__, -1};   \
+        &trySite__;                                              \
+    })
+#endif
+
+/**
+ * A single argument to THROWF, captured by value so that the message can be
+ * formatted later (or never) rather than at the point of the throw.
+ */
+typedef struct
+{
+    enum
+    {
+        EXCEPTION_ARG_INT__,
+        EXCEPTION_ARG_UNSIGNED__,
+        EXCEPTION_ARG_DOUBLE__,
+        EXCEPTION_ARG_STRING__,
+        EXCEPTION_ARG_POINTER__,
+    } kind;
+    union
+    {
+        long long i;
+        unsigned long long u;
+        double d;
+        const char *s;
+        const void *p;
+    } value;
+} ExceptionArg__;
+
 noreturn void throw__(int value, const char *message);
+noreturn void throwPayload__(int value, const char *message,
+                             const void *payload, size_t payloadSize);
+noreturn void throwf__(int value, const char *format, int argCount,
+                       const ExceptionArg__ *args);
+// Never defined, only used in sizeof so that THROWF arguments get checked
+__attribute__((format(printf, 1, 2))) int checkFormat__(const char *format,
+                                                         ...);
 noreturn void rethrow__(void);
-void endTry__(void);
+void uncatch__(void);
+int holdException__(void);
+Exception catchException__(void);
 
 /**
  * Throw an exception of type t with message m
@@ -111,57 +272,292 @@ void endTry__(void);
  */
 #define THROW(t, m) throw__(t, m)
 
+static inline ExceptionArg__
+exceptionIntArg__(long long value)
+{
+    return (ExceptionArg__){EXCEPTION_ARG_INT__, {.i = value}};
+}
+
+static inline ExceptionArg__
+exceptionUnsignedArg__(unsigned long long value)
+{
+    return (ExceptionArg__){EXCEPTION_ARG_UNSIGNED__, {.u = value}};
+}
+
+static inline ExceptionArg__
+exceptionDoubleArg__(double value)
+{
+    return (ExceptionArg__){EXCEPTION_ARG_DOUBLE__, {.d = value}};
+}
+
+static inline ExceptionArg__
+exceptionStringArg__(const char *value)
+{
+    return (ExceptionArg__){EXCEPTION_ARG_STRING__, {.s = value}};
+}
+
+static inline ExceptionArg__
+exceptionPointerArg__(const void *value)
+{
+    return (ExceptionArg__){EXCEPTION_ARG_POINTER__, {.p = value}};
+}
+
+#define EXCEPTION_ARG__(x)                                             \
+    _Generic((x),                                                      \
+             _Bool: exceptionIntArg__,                                 \
+             char: exceptionIntArg__,                                  \
+             signed char: exceptionIntArg__,                           \
+             short: exceptionIntArg__,                                 \
+             int: exceptionIntArg__,                                   \
+             long: exceptionIntArg__,                                  \
+             long long: exceptionIntArg__,                             \
+             unsigned char: exceptionUnsignedArg__,                    \
+             unsigned short: exceptionUnsignedArg__,                   \
+             unsigned int: exceptionUnsignedArg__,                     \
+             unsigned long: exceptionUnsignedArg__,                    \
+             unsigned long long: exceptionUnsignedArg__,               \
+             float: exceptionDoubleArg__,                              \
+             double: exceptionDoubleArg__,                             \
+             long double: exceptionDoubleArg__,                        \
+             char *: exceptionStringArg__,                             \
+             const char *: exceptionStringArg__,                       \
+             default: exceptionPointerArg__)(x)
+
+// Counts the arguments to THROWF after the format, up to 16
+#define EXCEPTION_NARGS__(...)                                           \
+    EXCEPTION_NARGS_N__(0, ##__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, \
+                        8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define EXCEPTION_NARGS_N__(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, \
+                            _11, _12, _13, _14, _15, _16, N, ...)        \
+    N
+
+#define EXCEPTION_ARGS__0()
+#define EXCEPTION_ARGS__1(a) EXCEPTION_ARG__(a)
+#define EXCEPTION_ARGS__2(a, ...) EXCEPTION_ARG__(a), EXCEPTION_ARGS__1(__VA_ARGS__)
+#define EXCEPTION_ARGS__3(a, ...) EXCEPTION_ARG__(a), EXCEPTION_ARGS__2(__VA_ARGS__)
+#define EXCEPTION_ARGS__4(a, ...) EXCEPTION_ARG__(a), EXCEPTION_ARGS__3(__VA_ARGS__)
+#define EXCEPTION_ARGS__5(a, ...) EXCEPTION_ARG__(a), EXCEPTION_ARGS__4(__VA_ARGS__)
+#define EXCEPTION_ARGS__6(a, ...) EXCEPTION_ARG__(a), EXCEPTION_ARGS__5(__VA_ARGS__)
+#define EXCEPTION_ARGS__7(a, ...) EXCEPTION_ARG__(a), EXCEPTION_ARGS__6(__VA_ARGS__)
+#define EXCEPTION_ARGS__8(a, ...) EXCEPTION_ARG__(a), EXCEPTION_ARGS__7(__VA_ARGS__)
+#define EXCEPTION_ARGS__9(a, ...) EXCEPTION_ARG__(a), EXCEPTION_ARGS__8(__VA_ARGS__)
+#define EXCEPTION_ARGS__10(a, ...) EXCEPTION_ARG__(a), EXCEPTION_ARGS__9(__VA_ARGS__)
+#define EXCEPTION_ARGS__11(a, ...) EXCEPTION_ARG__(a), EXCEPTION_ARGS__10(__VA_ARGS__)
+#define EXCEPTION_ARGS__12(a, ...) EXCEPTION_ARG__(a), EXCEPTION_ARGS__11(__VA_ARGS__)
+#define EXCEPTION_ARGS__13(a, ...) EXCEPTION_ARG__(a), EXCEPTION_ARGS__12(__VA_ARGS__)
+#define EXCEPTION_ARGS__14(a, ...) EXCEPTION_ARG__(a), EXCEPTION_ARGS__13(__VA_ARGS__)
+#define EXCEPTION_ARGS__15(a, ...) EXCEPTION_ARG__(a), EXCEPTION_ARGS__14(__VA_ARGS__)
+#define EXCEPTION_ARGS__16(a, ...) EXCEPTION_ARG__(a), EXCEPTION_ARGS__15(__VA_ARGS__)
+
+#define THROWF_WITH_FORMAT__(t, format, ...)                                 \
+    throwf__(t, format + 0 * sizeof(checkFormat__(format, ##__VA_ARGS__)),   \
+             EXCEPTION_NARGS__(__VA_ARGS__),                                 \
+             (const ExceptionArg__[]){EXCEPTIONS_CONCAT__(                   \
+                 EXCEPTION_ARGS__, EXCEPTION_NARGS__(__VA_ARGS__))(__VA_ARGS__)})
+
 /**
- * Can only be used within a CATCH or a CATCH_ALL block. Will throw the current
- * exception again.
+ * Throw an exception of type t with a printf style formatted message.
+ *
+ * The message isn't formatted when it is thrown. Instead the arguments are
+ * captured (copying any strings) and the message is only formatted if
+ * something reads it, so throwing in a loop and catching with CATCH is cheap.
+ * CATCH_ALL and catchMessage__ will format it.
+ *
+ * The format string must outlive the exception, like the message passed to
+ * THROW. Up to 16 arguments are supported, and length modifiers such as l
+ * and h are ignored since the type of each argument is already known.
  *
- * BUG: Rethrow will skip the execution of the FINALLY block.
+ * The captured arguments and the message live in a per-thread arena rather
+ * than being allocated, and are only valid until the TRY block which catches
+ * the exception finishes, when its part of the arena is given back. If the
+ * arena is full, the format string itself is used as the message, and a
+ * message which doesn't fit in the space left is truncated.
+ *
+ * @param t The type of exception that is being thrown
+ * @param ... The format string followed by its arguments
  */
-#define RETHROW rethrow__();
+#define THROWF(t, ...) THROWF_WITH_FORMAT__(t, __VA_ARGS__)
 
-typedef struct
+/**
+ * Throw an exception of type t with message m and a copy of the value p
+ * attached, which can be read back with EXCEPTION_PAYLOAD in a CATCH_ALL.
+ *
+ * Like THROWF, the copy lives in the per-thread arena until the TRY block
+ * which catches the exception finishes. If it does not fit, the exception is
+ * thrown without a payload.
+ *
+ * @param t The type of exception that is being thrown
+ * @param m The message
+ * @param p The value to attach, e.g. a struct describing the error
+ */
+#define THROW_PAYLOAD(t, m, p)                                    \
+    do                                                            \
+    {                                                             \
+        __typeof__(p) payload__ = (p);                            \
+        throwPayload__(t, m, &payload__, sizeof(payload__));      \
+    } while (0)
+
+/**
+ * Get the payload of the exception e (from CATCH_ALL(e)) as a pointer to type
+ * T, or NULL if the exception doesn't have a payload of that size.
+ *
+ * @param e The exception
+ * @param T The type passed to THROW_PAYLOAD
+ */
+#define EXCEPTION_PAYLOAD(e, T)                     \
+    ((e).payload && (e).payloadSize == sizeof(T)    \
+         ? (const T *)(e).payload                   \
+         : (const T *)0)
+
+/**
+ * Call fn(arg) when the innermost TRY block is left, instead of needing a
+ * TRY / FINALLY for every resource. Cleanups run in the reverse of the order
+ * that they were deferred in:
+ *
+ * - if an exception is thrown, before jumping to the CATCH blocks (like
+ *   destructors in C++)
+ * - otherwise after the FINALLY block
+ *
+ * Deferring is just a few stores, so one TRY can look after any number of
+ * resources. It must be used inside a TRY block, and fn shouldn't throw.
+ *
+ * @param fn A function taking a void *, e.g. free
+ * @param arg What to pass to fn
+ */
+#define DEFER(fn, arg) defer__((fn), (arg))
+
+// How many DEFERs can be waiting to run on a single thread. Any more throws
+// CALL_STACK_EXCEEDED_EXCEPTION. An ABI setting, which must match the library.
+#ifndef MAX_DEFERRED
+#define MAX_DEFERRED 128
+#endif
+
+/**
+ * Can only be used within a CATCH or a CATCH_ALL block. Will throw the current
+ * exception again, after running the FINALLY block of the same TRY.
+ */
+#define RETHROW                            \
+    ({                                     \
+        uncatch__();                       \
+        TRY_ENTER_FINALLY__(tryData__);    \
+        goto *tryData__.continueLabel;     \
+    });
+
+typedef struct TryData__
 {
     int tryAttempt;
-    int runFourTimes;
+    int state;
     void *returnTo;
     void *continueLabel;
+    // The enclosing TRY in the same function, or the file scope tryData__
+    struct TryData__ *outer;
 } TryData__;
 
+// The TRY / CATCH blocks run first, then the FINALLY block. A RETURN from the
+// FINALLY block skips straight to leaving the TRY.
+#define TRY_STATE_BODY__ 0
+#define TRY_STATE_FINALLY__ 1
+#define TRY_STATE_DONE__ 2
+#define TRY_STATE_LEAVING__ 3
+
+// Moves a TRY on to its FINALLY pass. An exception which wasn't caught is held
+// in the TRY's frame until then, so that a TRY in the FINALLY block can't
+// replace it, and tryAttempt is left non zero only if there is one.
+#define TRY_ENTER_FINALLY__(tryData)                         \
+    ({                                                       \
+        (tryData).state = TRY_STATE_FINALLY__;               \
+        if ((tryData).tryAttempt != 0)                       \
+        {                                                    \
+            (tryData).tryAttempt = holdException__();        \
+        }                                                    \
+    })
+
+// Sets up a TRY to be jumped back into to leave it through its FINALLY
+#define TRY_PREPARE_RETURN__(tryData)                  \
+    ({                                                 \
+        if ((tryData).state == TRY_STATE_BODY__)       \
+        {                                              \
+            TRY_ENTER_FINALLY__(tryData);              \
+        }                                              \
+        else                                           \
+        {                                              \
+            (tryData).state = TRY_STATE_LEAVING__;     \
+        }                                              \
+    })
+
+/*
+ * Stands in for the enclosing TRY of the outermost TRY in a function, so that
+ * each TRY can refer to the tryData__ outside of it. It has no continueLabel,
+ * so it is never written to, and being const means that using RETURN or
+ * RETHROW outside of a TRY won't compile.
+ */
+static const TryData__ tryData__ __attribute__((unused));
+
+#define EXCEPTIONS_CONCAT1__(a, b) a##b
+#define EXCEPTIONS_CONCAT__(a, b) EXCEPTIONS_CONCAT1__(a, b)
+
+/*
+ * Runs after each pass through the TRY. After the TRY / CATCH pass it moves on
+ * to the FINALLY pass, after the FINALLY pass it pops the TRY and either
+ * rethrows an exception which wasn't caught or finishes a RETURN.
+ */
+#define TRY_NEXT_STATE__                          \
+    ({                                            \
+        if (tryData__.state == TRY_STATE_BODY__)  \
+        {                                         \
+            TRY_ENTER_FINALLY__(tryData__);       \
+        }                                         \
+        else                                      \
+        {                                         \
+            if (tryData__.tryAttempt != 0)        \
+            {                                     \
+                rethrow__();                      \
+            }                                     \
+            endTry__();                           \
+            tryData__.state = TRY_STATE_DONE__;   \
+            if (tryData__.returnTo)               \
+            {                                     \
+                TRY_RETURN_THROUGH_OUTER__;       \
+                goto *tryData__.returnTo;         \
+            }                                     \
+        }                                         \
+    })
+
+// Passes a RETURN on to the enclosing TRY in the same function, if there is
+// one, which will pass it on again once its FINALLY block has run
+#define TRY_RETURN_THROUGH_OUTER__                                   \
+    if (tryData__.outer->continueLabel)                              \
+    {                                                                \
+        tryData__.outer->returnTo = tryData__.returnTo;              \
+        TRY_PREPARE_RETURN__(*tryData__.outer);                      \
+        goto *tryData__.outer->continueLabel;                        \
+    }
+
+// tryOuter__ is initialised before the new tryData__ comes into scope, so it
+// points at the enclosing one. The cast is for the file scope tryData__.
+#define TRY_WITH_LABEL__(continueLabel)                                    \
+    for (TryData__ *tryOuter__ = (TryData__ *)&tryData__,                  \
+                   tryData__ = {EXCEPTION_SETJMP__(*try__(TRY_SITE__)),    \
+                                TRY_STATE_BODY__, (void *)0,               \
+                                &&continueLabel, tryOuter__};              \
+         tryData__.state != TRY_STATE_DONE__; TRY_NEXT_STATE__)            \
+    continueLabel:                                                         \
+        if (tryData__.state == TRY_STATE_BODY__ && tryData__.tryAttempt == 0)
+
 /**
  * Start an exception block
  */
-#define TRY                                                           \
-    for (TryData__ tryData__ =                                        \
-             {setjmp(exceptionStack__[try__(__FILE__, __LINE__)]), 0, \
-              (void *)0, (void *)0};                                  \
-         tryData__.runFourTimes <= 3; tryData__.runFourTimes++)       \
-        if (tryData__.runFourTimes == 0)                              \
-        {                                                             \
-            __label__ continueLabel;                                  \
-            tryData__.continueLabel = &&continueLabel;                \
-        continueLabel:;                                               \
-        }                                                             \
-        else if (tryData__.runFourTimes == 3)                         \
-        {                                                             \
-            if (!catchHandled__())                                    \
-            {                                                         \
-                RETHROW;                                              \
-            }                                                         \
-            endTry__();                                               \
-            if (tryData__.returnTo)                                   \
-            {                                                         \
-                goto *tryData__.returnTo;                             \
-            }                                                         \
-        }                                                             \
-        else if (tryData__.runFourTimes == 1 && tryData__.tryAttempt == 0)
-
-/**
- * Catch a specific type of exception.
+#define TRY TRY_WITH_LABEL__(EXCEPTIONS_CONCAT__(tryContinue__, __COUNTER__))
+
+/**
+ * Catch a specific type of exception, or any type registered as one of its
+ * descendants with registerExceptionType.
  *
  * @param value The exception to catch
  */
-#define CATCH(value)                                                           \
-    else if (tryData__.runFourTimes == 1 && tryData__.tryAttempt == (value) && \
+#define CATCH(value)                                            \
+    else if (tryData__.state == TRY_STATE_BODY__ &&             \
+             exceptionIsA__(tryData__.tryAttempt, (value)) &&   \
              (catchHandled__() || 1))
 
 /**
@@ -170,34 +566,37 @@ typedef struct
  *
  * @param e The name of the exception variable
  */
-#define CATCH_ALL(e)                                                         \
-    else if (tryData__.runFourTimes == 1 && tryData__.tryAttempt > 0 &&      \
-             (catchHandled__() ||                                            \
-              1)) for (volatile Exception e = {.type = tryData__.tryAttempt, \
-                                               .message = catchMessage__()}; \
+#define CATCH_ALL(e)                                                 \
+    else if (tryData__.state == TRY_STATE_BODY__ &&                  \
+             tryData__.tryAttempt > 0 &&                             \
+             (catchHandled__() ||                                    \
+              1)) for (volatile Exception e = catchException__();    \
                        (e).type != -1; (e).type = -1)
 
 /**
  * This block will get called regardless of whether or not an exception was
  * thrown.
  */
-#define FINALLY else if (tryData__.runFourTimes == 2)
+#define FINALLY else if (tryData__.state == TRY_STATE_FINALLY__)
 
 /**
  * This must be used if you wish to return a value within a TRY or CATCH block.
- * It will ensure that the FINALLY block gets run first.
+ * It will ensure that the FINALLY block gets run first. Within a FINALLY block
+ * of a TRY which is passing an exception on, the exception wins and the
+ * function doesn't return.
  *
  * @param x The value to return
  */
-#define RETURN(x)                           \
-    do                                      \
-    {                                       \
-        __label__ returnPoint;              \
-        __auto_type retValue = (x);         \
-        tryData__.returnTo = &&returnPoint; \
-        goto *tryData__.continueLabel;      \
-    returnPoint:                            \
-        return retValue;                    \
+#define RETURN(x)                                  \
+    do                                             \
+    {                                              \
+        __label__ returnPoint;                     \
+        __auto_type retValue = (x);                \
+        tryData__.returnTo = &&returnPoint;        \
+        TRY_PREPARE_RETURN__(tryData__);           \
+        goto *tryData__.continueLabel;             \
+    returnPoint:                                   \
+        return retValue;                           \
     } while (0)
 
 /**
@@ -213,4 +612,215 @@ typedef enum
     OUT_OF_RANGE_EXCEPTION,          /** Operation failed bounds check */
     CALL_STACK_EXCEEDED_EXCEPTION,   /** Stack overflow */
     RANDOM_SEEDING_FAILED_EXCEPTION, /** Failed to read the random seed */
+    SEGMENTATION_FAULT_EXCEPTION,    /** SIGSEGV, see enableSignalExceptions */
+    FLOATING_POINT_EXCEPTION,        /** SIGFPE, see enableSignalExceptions */
+    BUS_ERROR_EXCEPTION,             /** SIGBUS, see enableSignalExceptions */
 } Exceptions;
+
+/**
+ * Turn SIGSEGV, SIGFPE and SIGBUS into SEGMENTATION_FAULT_EXCEPTION,
+ * FLOATING_POINT_EXCEPTION and BUS_ERROR_EXCEPTION, thrown to the innermost
+ * TRY on the thread which caused them. If the thread isn't in a TRY block,
+ * the signal gets its default action (normally a core dump) as usual.
+ *
+ * The handlers run on an alternate signal stack so that a stack overflow can
+ * be caught too. Each thread gets one on its first TRY after this is called,
+ * so threads which have already used TRY should call this again themselves.
+ *
+ * This is only safe when the fault is in code which can be abandoned part
+ * way through, e.g. not while holding a lock or inside malloc.
+ *
+ * @return 0 on success, or -1 if the handlers couldn't be installed
+ */
+int enableSignalExceptions(void);
+
+// Only exception types below this can be given a parent. An ABI setting, which
+// must match the library.
+#ifndef MAX_EXCEPTION_TYPES
+#define MAX_EXCEPTION_TYPES 256
+#endif
+
+/*
+ * Each registered type covers the interval [enter, exit) of a depth first
+ * walk of the type hierarchy, so its descendants are exactly the types whose
+ * enter lies inside its interval. Unregistered types have an empty interval.
+ */
+typedef struct
+{
+    int enter;
+    int exit;
+} ExceptionTypeRange__;
+
+extern ExceptionTypeRange__ exceptionTypeRanges__[MAX_EXCEPTION_TYPES];
+
+/**
+ * Register type as a child of parent, so that CATCH(parent) will also catch
+ * type (and anything registered under type). Pass 0 as the parent to create a
+ * new family with type at the top.
+ *
+ * Types should be registered before any exceptions are thrown, as CATCH reads
+ * the hierarchy without taking a lock.
+ *
+ * @param type The exception type, between 1 and MAX_EXCEPTION_TYPES - 1
+ * @param parent A registered exception type, or 0
+ * @return 0 on success, or -1 if either type is out of range, the parent
+ * isn't registered, or type is already registered with a different parent
+ */
+int registerExceptionType(int type, int parent);
+
+// How many TRY sites have their own statistics. Any more share slot 0. An ABI
+// setting, which must match the library.
+#ifndef MAX_TRY_SITES
+#define MAX_TRY_SITES 256
+#endif
+
+// The statistics slot for exception types of MAX_EXCEPTION_TYPES and above
+#define OTHER_EXCEPTION_TYPES MAX_EXCEPTION_TYPES
+
+/**
+ * Counts of what the exception machinery has done, summed over every thread
+ * (including ones which have exited) by getExceptionStats.
+ */
+typedef struct
+{
+    /** How many exceptions of each type were thrown by THROW and friends */
+    unsigned long long thrown[MAX_EXCEPTION_TYPES + 1];
+    /** How many exceptions of each type were caught by CATCH or CATCH_ALL */
+    unsigned long long caught[MAX_EXCEPTION_TYPES + 1];
+    /** How many times RETHROW was used */
+    unsigned long long rethrown;
+    /** How many exceptions weren't caught by anything */
+    unsigned long long unhandled;
+    /** The deepest that TRY blocks have been nested on any thread */
+    int maxDepth;
+    /**
+     * How many of sites are filled in. Slot 0 counts every TRY without its
+     * own slot (all of them with EXCEPTIONS_NO_SOURCE_INFO).
+     */
+    int siteCount;
+    struct
+    {
+        /** Where the TRY is, or NULL for slot 0 */
+        const char *fileName;
+        int lineNumber;
+        /** How many times the TRY block was entered */
+        unsigned long long entries;
+    } sites[MAX_TRY_SITES];
+} ExceptionStats;
+
+/**
+ * Take a snapshot of the exception statistics. The counters are maintained
+ * per thread without any locking, so counts from threads which are still
+ * running may be a little behind.
+ *
+ * Defining EXCEPTIONS_NO_TRY_STATS (for the library and all code using it)
+ * stops TRY from counting its entries and how deeply it is nested, so that
+ * entering a TRY doesn't touch the counters. The site entries and maxDepth
+ * then stay at zero, while throws, catches and the rest are still counted.
+ *
+ * @param stats Where to store the snapshot
+ */
+void getExceptionStats(ExceptionStats *stats);
+
+/**
+ * Turn tracing on or off for all threads (it starts off). While it is on,
+ * each thread records every throw, catch, rethrow and FINALLY into its own
+ * ring buffer of the last EXCEPTION_TRACE_EVENTS events.
+ *
+ * @param enable Whether to record events
+ */
+void setExceptionTracing(int enable);
+
+/**
+ * Write the trace ring buffers of every running thread to the file
+ * descriptor fd in the binary format described in exceptions_trace.h, which
+ * exceptions_trace_decode can turn into text. Threads which are still
+ * throwing while this runs may have their newest events garbled.
+ *
+ * @param fd Where to write the trace
+ * @return 0 on success, or -1 if writing failed
+ */
+int dumpExceptionTrace(int fd);
+
+/**
+ * Everything which belongs to one exception stack: the TRY blocks, the
+ * exception in flight, its THROWF / THROW_PAYLOAD arena and the waiting
+ * DEFERs. Each thread starts off with its own.
+ */
+typedef struct ExceptionContext__ ExceptionContext;
+
+/**
+ * Create an empty exception context, e.g. for a new coroutine.
+ *
+ * @return The context, or NULL if it couldn't be allocated
+ */
+ExceptionContext *createExceptionContext(void);
+
+/**
+ * Free a context from createExceptionContext. It mustn't be in use by any
+ * thread, and any TRY blocks it was in are abandoned without running their
+ * FINALLY blocks or DEFERs.
+ *
+ * @param context The context to destroy
+ */
+void destroyExceptionContext(ExceptionContext *context);
+
+/**
+ * Make TRY, THROW and CATCH on this thread use context until it is swapped
+ * out again. A scheduler which switches between coroutines on one thread
+ * should swap in the incoming coroutine's context at the same time as its
+ * stack, so that a coroutine which is suspended inside a TRY block doesn't
+ * share an exception stack with whichever one runs next.
+ *
+ * This is a single store, so it is cheap enough to do on every switch.
+ *
+ * @code{.c}
+ * ExceptionContext *schedulerContext = swapExceptionContext(task->exceptions);
+ * swapcontext(&scheduler, &task->context);
+ * swapExceptionContext(schedulerContext);
+ * @endcode
+ *
+ * @param context The context to use, or NULL for the thread's own context
+ * @return The context which was in use before
+ */
+ExceptionContext *swapExceptionContext(ExceptionContext *context);
+
+// Whether an exception of type thrown should be caught by CATCH(caught)
+static inline int
+exceptionIsA__(int thrown, int caught)
+{
+    if (thrown == caught)
+    {
+        return 1;
+    }
+    if ((unsigned)thrown >= MAX_EXCEPTION_TYPES ||
+        (unsigned)caught >= MAX_EXCEPTION_TYPES)
+    {
+        return 0;
+    }
+
+    int enter = exceptionTypeRanges__[thrown].enter;
+    return (unsigned)(enter - exceptionTypeRanges__[caught].enter) <
+           (unsigned)(exceptionTypeRanges__[caught].exit -
+                      exceptionTypeRanges__[caught].enter);
+}
+
+/*
+ * Defining EXCEPTIONS_INLINE before including this header makes the functions
+ * called by TRY and CATCH static inline, so that they can be optimised along
+ * with the code using them instead of being out of line calls into
+ * exceptions.c.
+ */
+#ifdef EXCEPTIONS_INLINE
+#include "exceptions_inline.h"
+#else
+#ifdef EXCEPTIONS_NO_SOURCE_INFO
+ExceptionJmpBuf__ *try__(void);
+#else
+ExceptionJmpBuf__ *try__(TrySite__ *site);
+#endif
+int catchHandled__(void);
+void defer__(void (*fn)(void *), void *arg);
+const char *catchMessage__(void);
+void endTry__(void);
+#endif
@@ -0,0 +1,514 @@
+/*
+ * Copyright (c) 2020 Gwilym Kuiper <gw@ilym.me>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Micro-benchmarks for each of the exception handling paths.
+ *
+ * Each benchmark is warmed up and then timed over a number of samples, where
+ * each sample is a batch of operations. The results are printed as CSV (one
+ * line per benchmark and depth) with the min, median and 99th percentile
+ * time per operation, plus cycle counts where rdtsc is available.
+ *
+ * The Makefile builds this once per EXCEPTIONS_BACKEND, and once more with
+ * EXCEPTIONS_INLINE.
+ *
+ * Usage: exceptions_bench [benchmark name substring]
+ */
+
+#include "exceptions.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAS_CYCLES 1
+#define readCycles() __rdtsc()
+#else
+#define HAS_CYCLES 0
+#define readCycles() 0
+#endif
+
+#if EXCEPTIONS_BACKEND == EXCEPTIONS_BACKEND_SETJMP
+#define BACKEND_NAME__ "setjmp"
+#elif EXCEPTIONS_BACKEND == EXCEPTIONS_BACKEND_UNDERSCORE
+#define BACKEND_NAME__ "_setjmp"
+#elif EXCEPTIONS_BACKEND == EXCEPTIONS_BACKEND_MINIMAL
+#define BACKEND_NAME__ "minimal"
+#endif
+
+#ifdef EXCEPTIONS_INLINE
+#define BACKEND_NAME BACKEND_NAME__ "+inline"
+#else
+#define BACKEND_NAME BACKEND_NAME__
+#endif
+
+#define WARMUP_SAMPLES 10
+#define SAMPLES 200
+// Roughly how many TRY blocks are run in a single sample
+#define OPERATIONS_PER_SAMPLE 2000
+
+#define BENCH_EXCEPTION OUT_OF_RANGE_EXCEPTION
+
+// A chain of exception types, each registered as a child of the previous one
+#define BASE_EXCEPTION 200
+#define HIERARCHY_DEPTH 8
+#define LEAF_EXCEPTION (BASE_EXCEPTION + HIERARCHY_DEPTH - 1)
+
+static volatile int sink;
+
+typedef void (*benchFunc)(int depth);
+
+typedef struct
+{
+    const char *name;
+    benchFunc fn;
+    // Whether the benchmark should be run at each depth or just once
+    bool usesDepth;
+} Benchmark;
+
+// noipa stops GCC from seeing that this never returns, which would make it
+// think callThenThrow recurses forever
+__attribute__((noipa)) static void
+throwSomething(void)
+{
+    THROW(BENCH_EXCEPTION, "benchmark exception");
+}
+
+// The bounds check failure that THROWF is meant for
+__attribute__((noipa)) static void
+throwOutOfRange(int index)
+{
+    THROWF(BENCH_EXCEPTION, "index %d out of range [%d, %d)", index, 0, 16);
+}
+
+// The same, but formatting the message up front
+__attribute__((noipa)) static void
+throwOutOfRangeEagerly(int index)
+{
+    static _Thread_local char message[64];
+    snprintf(message, sizeof(message), "index %d out of range [%d, %d)", index,
+             0, 16);
+    THROW(BENCH_EXCEPTION, message);
+}
+
+__attribute__((noinline)) static void
+callThenThrow(int depth)
+{
+    if (depth <= 1)
+    {
+        throwSomething();
+    }
+    else
+    {
+        callThenThrow(depth - 1);
+    }
+    sink++;
+}
+
+__attribute__((noinline)) static void
+nestTries(int depth)
+{
+    if (depth == 0)
+    {
+        sink++;
+        return;
+    }
+
+    TRY { nestTries(depth - 1); }
+}
+
+__attribute__((noinline)) static void
+nestTriesThenThrow(int depth)
+{
+    if (depth == 0)
+    {
+        throwSomething();
+    }
+
+    TRY { nestTriesThenThrow(depth - 1); }
+    FINALLY { sink++; }
+}
+
+__attribute__((noinline)) static int
+returnThroughFinally(void)
+{
+    TRY { RETURN(5); }
+    FINALLY { sink++; }
+
+    return 0;
+}
+
+__attribute__((noinline)) static int
+returnThroughNestedFinally(void)
+{
+    TRY
+    {
+        TRY
+        {
+            TRY { RETURN(5); }
+            FINALLY { sink++; }
+        }
+        FINALLY { sink++; }
+    }
+    FINALLY { sink++; }
+
+    return 0;
+}
+
+static void
+benchTryNoThrow(int depth)
+{
+    (void)depth;
+    TRY { sink++; }
+}
+
+static void
+benchTryFinallyNoThrow(int depth)
+{
+    (void)depth;
+    TRY { sink++; }
+    FINALLY { sink++; }
+}
+
+static void
+benchNestedTry(int depth)
+{
+    nestTries(depth);
+}
+
+static void
+benchThrowAcrossFrames(int depth)
+{
+    TRY { callThenThrow(depth); }
+    CATCH(BENCH_EXCEPTION) { sink++; }
+}
+
+static void
+benchThrowThroughFinally(int depth)
+{
+    TRY { nestTriesThenThrow(depth - 1); }
+    CATCH(BENCH_EXCEPTION) { sink++; }
+}
+
+static void
+benchThrowWithBacktrace(int depth)
+{
+    setExceptionBacktraces(1);
+    benchThrowAcrossFrames(depth);
+    setExceptionBacktraces(0);
+}
+
+static void
+benchCatchAll(int depth)
+{
+    (void)depth;
+    TRY { throwSomething(); }
+    CATCH_ALL(e) { sink += e.type; }
+}
+
+static void
+benchThrowfIgnored(int depth)
+{
+    (void)depth;
+    TRY { throwOutOfRange(sink); }
+    CATCH(BENCH_EXCEPTION) { sink++; }
+}
+
+static void
+benchThrowfRead(int depth)
+{
+    (void)depth;
+    TRY { throwOutOfRange(sink); }
+    CATCH_ALL(e) { sink += e.message[0]; }
+}
+
+static void
+benchEagerFormatIgnored(int depth)
+{
+    (void)depth;
+    TRY { throwOutOfRangeEagerly(sink); }
+    CATCH(BENCH_EXCEPTION) { sink++; }
+}
+
+__attribute__((noipa)) static void
+throwLeaf(void)
+{
+    THROW(LEAF_EXCEPTION, "benchmark exception");
+}
+
+static void
+benchCatchBaseType(int depth)
+{
+    (void)depth;
+    TRY { throwLeaf(); }
+    CATCH(BENCH_EXCEPTION) { sink--; }
+    CATCH(BASE_EXCEPTION) { sink++; }
+}
+
+static void
+releaseResource(void *resource)
+{
+    (void)resource;
+    sink++;
+}
+
+// Three resources, each protected by its own TRY / FINALLY
+static void
+benchTryFinallyResources(int depth)
+{
+    (void)depth;
+    TRY
+    {
+        TRY
+        {
+            TRY
+            {
+                TRY { throwSomething(); }
+                FINALLY { releaseResource(NULL); }
+            }
+            FINALLY { releaseResource(NULL); }
+        }
+        FINALLY { releaseResource(NULL); }
+    }
+    CATCH(BENCH_EXCEPTION) { releaseResource(NULL); }
+}
+
+// The same three resources, protected by DEFER in a single TRY
+static void
+benchDeferResources(int depth)
+{
+    (void)depth;
+    TRY
+    {
+        DEFER(releaseResource, NULL);
+        DEFER(releaseResource, NULL);
+        DEFER(releaseResource, NULL);
+        throwSomething();
+    }
+    CATCH(BENCH_EXCEPTION) { releaseResource(NULL); }
+}
+
+static void
+benchRethrow(int depth)
+{
+    (void)depth;
+    TRY
+    {
+        TRY { throwSomething(); }
+        CATCH(BENCH_EXCEPTION) { RETHROW; }
+    }
+    CATCH(BENCH_EXCEPTION) { sink++; }
+}
+
+static void
+benchRethrowThroughFinally(int depth)
+{
+    (void)depth;
+    TRY
+    {
+        TRY { throwSomething(); }
+        CATCH(BENCH_EXCEPTION) { RETHROW; }
+        FINALLY { sink++; }
+    }
+    CATCH(BENCH_EXCEPTION) { sink++; }
+}
+
+static void
+benchReturnThroughFinally(int depth)
+{
+    (void)depth;
+    sink += returnThroughFinally();
+}
+
+static void
+benchReturnThroughNestedFinally(int depth)
+{
+    (void)depth;
+    sink += returnThroughNestedFinally();
+}
+
+// What a coroutine scheduler does on each switch, plus a TRY in between to
+// show that the swapped in context is used straight away
+static void
+benchSwapContext(int depth)
+{
+    (void)depth;
+    static ExceptionContext *context;
+    if (!context)
+    {
+        context = createExceptionContext();
+    }
+
+    ExceptionContext *threadContext = swapExceptionContext(context);
+    TRY { sink++; }
+    swapExceptionContext(threadContext);
+}
+
+static const Benchmark benchmarks[] = {
+    {"try_no_throw", benchTryNoThrow, false},
+    {"try_finally_no_throw", benchTryFinallyNoThrow, false},
+    {"nested_try", benchNestedTry, true},
+    {"throw_across_frames", benchThrowAcrossFrames, true},
+    {"throw_through_finally", benchThrowThroughFinally, true},
+    {"throw_with_backtrace", benchThrowWithBacktrace, true},
+    {"catch_all", benchCatchAll, false},
+    {"throwf_ignored", benchThrowfIgnored, false},
+    {"throwf_read", benchThrowfRead, false},
+    {"eager_format_ignored", benchEagerFormatIgnored, false},
+    {"catch_base_type", benchCatchBaseType, false},
+    {"try_finally_resources", benchTryFinallyResources, false},
+    {"defer_resources", benchDeferResources, false},
+    {"rethrow", benchRethrow, false},
+    {"rethrow_through_finally", benchRethrowThroughFinally, false},
+    {"return_through_finally", benchReturnThroughFinally, false},
+    {"return_through_nested_finally", benchReturnThroughNestedFinally, false},
+    {"swap_context", benchSwapContext, false},
+};
+
+static const int depths[] = {1, 2, 4, 8, 16, 32, 64, 128};
+
+#define ARRAY_LENGTH(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef struct
+{
+    double ns;
+    double cycles;
+} Sample;
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Sorts the values and returns the given percentile
+static double
+percentile(double *values, int count, int percent)
+{
+    qsort(values, count, sizeof(double), compareDoubles);
+    return values[(count - 1) * percent / 100];
+}
+
+static Sample
+runSample(benchFunc fn, int depth, int operations)
+{
+    double start = now();
+    uint64_t startCycles = readCycles();
+    for (int i = 0; i < operations; i++)
+    {
+        fn(depth);
+    }
+    uint64_t cycles = readCycles() - startCycles;
+    double ns = now() - start;
+
+    return (Sample){.ns = ns / operations, .cycles = (double)cycles / operations};
+}
+
+static void
+runBenchmark(const Benchmark *benchmark, int depth)
+{
+    int operations = OPERATIONS_PER_SAMPLE / depth;
+    if (operations < 1)
+    {
+        operations = 1;
+    }
+
+    for (int i = 0; i < WARMUP_SAMPLES; i++)
+    {
+        runSample(benchmark->fn, depth, operations);
+    }
+
+    double ns[SAMPLES];
+    double cycles[SAMPLES];
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        Sample sample = runSample(benchmark->fn, depth, operations);
+        ns[i] = sample.ns;
+        cycles[i] = sample.cycles;
+    }
+
+    printf("%s,%s,%d,%d,%.2f,%.2f,%.2f", BACKEND_NAME, benchmark->name, depth,
+           SAMPLES * operations, percentile(ns, SAMPLES, 0),
+           percentile(ns, SAMPLES, 50), percentile(ns, SAMPLES, 99));
+    if (HAS_CYCLES)
+    {
+        printf(",%.1f,%.1f,%.1f\n", percentile(cycles, SAMPLES, 0),
+               percentile(cycles, SAMPLES, 50),
+               percentile(cycles, SAMPLES, 99));
+    }
+    else
+    {
+        printf(",,,\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *filter = argc > 1 ? argv[1] : "";
+
+    registerExceptionType(BASE_EXCEPTION, 0);
+    for (int i = 1; i < HIERARCHY_DEPTH; i++)
+    {
+        registerExceptionType(BASE_EXCEPTION + i, BASE_EXCEPTION + i - 1);
+    }
+
+    printf("backend,benchmark,depth,operations,min_ns,median_ns,p99_ns,"
+           "min_cycles,median_cycles,p99_cycles\n");
+
+    for (size_t i = 0; i < ARRAY_LENGTH(benchmarks); i++)
+    {
+        const Benchmark *benchmark = &benchmarks[i];
+        if (!strstr(benchmark->name, filter))
+        {
+            continue;
+        }
+
+        if (!benchmark->usesDepth)
+        {
+            runBenchmark(benchmark, 1);
+            continue;
+        }
+
+        for (size_t j = 0; j < ARRAY_LENGTH(depths); j++)
+        {
+            runBenchmark(benchmark, depths[j]);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2020 Gwilym Kuiper <gw@ilym.me>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "exceptions_future.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <sched.h>
+#endif
+
+// The task hasn't finished yet
+#define FUTURE_PENDING__ 0
+// The task hasn't finished, and a thread is waiting for it to
+#define FUTURE_WAITED_ON__ 1
+// The task returned a result
+#define FUTURE_DONE__ 2
+// An exception escaped from the task
+#define FUTURE_FAILED__ 3
+
+void initFuture(Future *future)
+{
+    memset(future, 0, sizeof(*future));
+    future->state = FUTURE_PENDING__;
+}
+
+void destroyFuture(Future *future)
+{
+    free(future->message);
+    free(future->payload);
+    initFuture(future);
+}
+
+// The message and payload are given back to the arena when the TRY which
+// caught the exception ends, so this has to be called from within its
+// CATCH_ALL, copying everything which the waiting thread will need
+static void
+captureException(Future *future, const Exception *e)
+{
+    future->type = e->type;
+    future->message = e->message ? strdup(e->message) : NULL;
+    if (e->payload && (future->payload = malloc(e->payloadSize)))
+    {
+        memcpy(future->payload, e->payload, e->payloadSize);
+        future->payloadSize = e->payloadSize;
+    }
+}
+
+static void
+completeFuture(Future *future, int state)
+{
+    int oldState = __atomic_exchange_n(&future->state, state, __ATOMIC_RELEASE);
+
+#ifdef __linux__
+    // Only make a system call if someone is actually waiting
+    if (oldState == FUTURE_WAITED_ON__)
+    {
+        syscall(SYS_futex, &future->state, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL,
+                NULL, 0);
+    }
+#else
+    (void)oldState;
+#endif
+}
+
+void runTask(Future *future, void *(*task)(void *), void *arg)
+{
+    volatile int state = FUTURE_DONE__;
+
+    TRY { future->result = task(arg); }
+    CATCH_ALL(e)
+    {
+        captureException(future, (const Exception *)&e);
+        state = FUTURE_FAILED__;
+    }
+
+    completeFuture(future, state);
+}
+
+int isFutureDone(const Future *future)
+{
+    return __atomic_load_n(&future->state, __ATOMIC_ACQUIRE) >= FUTURE_DONE__;
+}
+
+// Waits until the future is done, and returns its final state
+static int
+waitForFuture(Future *future)
+{
+    int state = __atomic_load_n(&future->state, __ATOMIC_ACQUIRE);
+    while (state < FUTURE_DONE__)
+    {
+#ifdef __linux__
+        // Let runTask know that it needs to wake us up
+        if (state == FUTURE_PENDING__ &&
+            !__atomic_compare_exchange_n(&future->state, &state,
+                                         FUTURE_WAITED_ON__, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+
+        syscall(SYS_futex, &future->state, FUTEX_WAIT_PRIVATE,
+                FUTURE_WAITED_ON__, NULL, NULL, 0);
+#else
+        sched_yield();
+#endif
+        state = __atomic_load_n(&future->state, __ATOMIC_ACQUIRE);
+    }
+
+    return state;
+}
+
+void *awaitFuture(Future *future)
+{
+    if (waitForFuture(future) == FUTURE_FAILED__)
+    {
+        if (future->payload)
+        {
+            throwPayload__(future->type, future->message, future->payload,
+                           future->payloadSize);
+        }
+        throw__(future->type, future->message);
+    }
+
+    return future->result;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2020 Gwilym Kuiper <gw@ilym.me>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file exceptions_future.h
+ * @author Gwilym Kuiper
+ * @brief Passes exceptions from one thread to another through futures
+ *
+ * An exception can only be caught on the thread which threw it, so a task run
+ * on a worker thread (e.g. from a thread pool) can't throw to whoever is
+ * waiting for its result. Instead, run the task with runTask, which stores
+ * either the task's result or a copy of the exception which escaped it in a
+ * Future. awaitFuture then returns the result, or throws the exception again
+ * on the waiting thread.
+ *
+ * @code{.c}
+ * Future future;
+ * initFuture(&future);
+ *
+ * // On a worker thread
+ * runTask(&future, parseRequest, request);
+ *
+ * // On the thread which wants the result
+ * TRY {
+ *   Response *response = awaitFuture(&future);
+ * } CATCH(OUT_OF_RANGE_EXCEPTION) {
+ *   // parseRequest threw OUT_OF_RANGE_EXCEPTION on the worker thread
+ * }
+ * destroyFuture(&future);
+ * @endcode
+ */
+#pragma once
+
+#include "exceptions.h"
+
+#include <stddef.h>
+
+/**
+ * The result of a task. Only use it through the functions below.
+ */
+typedef struct
+{
+    // One of the FUTURE_*__ states in exceptions_future.c
+    int state;
+    void *result;
+    // The exception which escaped the task, if there was one
+    int type;
+    char *message;
+    void *payload;
+    size_t payloadSize;
+} Future;
+
+/**
+ * Set up a future before passing it to runTask.
+ *
+ * @param future The future
+ */
+void initFuture(Future *future);
+
+/**
+ * Free anything which the future holds. It mustn't be in use by runTask or
+ * awaitFuture.
+ *
+ * @param future The future
+ */
+void destroyFuture(Future *future);
+
+/**
+ * Call task(arg) on this thread and complete the future with what it
+ * returns, or with a copy of the type, message and payload of any exception
+ * which escapes it. Each future can only be run once.
+ *
+ * @param future The future to complete
+ * @param task The task to run
+ * @param arg What to pass to the task
+ */
+void runTask(Future *future, void *(*task)(void *), void *arg);
+
+/**
+ * Whether the future has been completed by runTask, without waiting.
+ *
+ * @param future The future
+ * @return 1 if awaitFuture would return (or throw) straight away, otherwise 0
+ */
+int isFutureDone(const Future *future);
+
+/**
+ * Wait for the future to be completed by runTask. Once it has been, this
+ * doesn't make any system calls.
+ *
+ * @param future The future
+ * @return What the task returned. If the task threw an exception instead,
+ * the same type of exception is thrown with the same message and payload.
+ * This happens every time the future is awaited.
+ */
+void *awaitFuture(Future *future);
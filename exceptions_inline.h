@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2020 Gwilym Kuiper <gw@ilym.me>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The hot path of the exception runtime.
+ *
+ * This is included by exceptions.h when EXCEPTIONS_INLINE is defined, making
+ * all of the functions here static inline so that the compiler can fold them
+ * into each TRY. Otherwise it is only included by exceptions.c, which provides
+ * the out of line copies.
+ */
+#pragma once
+
+#include "exceptions_trace.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// The hard limit on how deeply TRY blocks can be nested on a single thread.
+// Going beyond this throws CALL_STACK_EXCEEDED_EXCEPTION. This and the other
+// limits below are ABI settings, which must match the library (see the top of
+// exceptions.h).
+#ifndef MAX_TRY_DEPTH
+#define MAX_TRY_DEPTH 1024
+#endif
+
+// The exception stack grows in chunks of this many TRY blocks
+#ifndef TRY_CHUNK_SIZE
+#define TRY_CHUNK_SIZE 16
+#endif
+
+#define NUM_TRY_CHUNKS__ ((MAX_TRY_DEPTH + TRY_CHUNK_SIZE - 1) / TRY_CHUNK_SIZE)
+
+#define CACHE_LINE_SIZE__ 64
+
+typedef struct
+{
+    int type;
+    const char *message;
+    const void *payload;
+    size_t payloadSize;
+    bool handled;
+    // Set by THROWF until the message has been formatted
+    const char *format;
+    const ExceptionArg__ *args;
+    int argCount;
+    // Where the exception was thrown from, if backtraces are enabled
+    void *const *backtrace;
+    int backtraceLength;
+} CurrentException__;
+
+// Everything needed for a single TRY block. The site comes first so that it
+// shares a cache line with the registers which setjmp saves.
+typedef struct
+{
+#ifndef EXCEPTIONS_NO_SOURCE_INFO
+    TrySite__ *site;
+#endif
+    // How much of the arena was in use when the TRY was entered
+    size_t arenaMark;
+    ExceptionJmpBuf__ buffer;
+    // An exception which wasn't caught, kept here while the FINALLY block runs
+    CurrentException__ held;
+} __attribute__((aligned(CACHE_LINE_SIZE__))) TryFrame__;
+
+typedef struct
+{
+    TryFrame__ frames[TRY_CHUNK_SIZE];
+} TryChunk__;
+
+// A cleanup registered with DEFER, to be run when the TRY at depth is left
+typedef struct
+{
+    void (*fn)(void *);
+    void *arg;
+    int depth;
+} DeferredCleanup__;
+
+// This thread's part of ExceptionStats. Only the owning thread writes to it,
+// but getExceptionStats reads it from other threads.
+typedef struct ThreadStats__
+{
+    unsigned long long tryEntries[MAX_TRY_SITES];
+    unsigned long long thrown[MAX_EXCEPTION_TYPES + 1];
+    unsigned long long caught[MAX_EXCEPTION_TYPES + 1];
+    unsigned long long rethrown;
+    unsigned long long unhandled;
+    unsigned maxDepth;
+    struct ThreadStats__ *next;
+} ThreadStats__;
+
+// A relaxed store rather than an atomic increment, since there is only one
+// writer and this keeps it a plain add
+#define STATS_ADD__(counter) \
+    __atomic_store_n(&(counter), (counter) + 1, __ATOMIC_RELAXED)
+
+// The size of each context's arena used for THROWF messages and THROW_PAYLOAD
+// payloads. Each TRY block gives back whatever was allocated inside it when it
+// finishes.
+#ifndef EXCEPTION_ARENA_SIZE
+#define EXCEPTION_ARENA_SIZE 4096
+#endif
+
+// The most return addresses recorded for a single exception
+#ifndef EXCEPTION_BACKTRACE_DEPTH
+#define EXCEPTION_BACKTRACE_DEPTH 32
+#endif
+
+// captureBacktrace and the throw function which called it
+#define BACKTRACE_SKIP__ 2
+
+// The things which are used on every TRY come first
+struct ExceptionContext__
+{
+    int depth;
+    // The first chunk is part of the context, the rest are allocated the
+    // first time the stack gets that deep and are then kept until the context
+    // is destroyed. Chunks are never moved, so a buffer handed out by try__
+    // stays valid.
+    TryChunk__ *tryChunks[NUM_TRY_CHUNKS__];
+    CurrentException__ currentException;
+    // The cleanups waiting to run, which are always in order of depth
+    int deferredCount;
+    DeferredCleanup__ deferred[MAX_DEFERRED];
+    // How much of the arena is in use
+    size_t arenaUsed;
+    char arena[EXCEPTION_ARENA_SIZE]
+        __attribute__((aligned(__BIGGEST_ALIGNMENT__)));
+    void *backtrace[EXCEPTION_BACKTRACE_DEPTH + BACKTRACE_SKIP__];
+    TryChunk__ firstChunk;
+};
+
+// The context in use on this thread, or NULL for the thread's own one (which
+// can't be the initial value, since it isn't a constant address)
+extern _Thread_local ExceptionContext *exceptionContext__;
+extern _Thread_local ThreadStats__ threadStats__;
+// Whether setExceptionTracing is on
+extern int exceptionTracing__;
+#define TRACING__() \
+    __builtin_expect(__atomic_load_n(&exceptionTracing__, __ATOMIC_RELAXED), 0)
+
+ExceptionContext *threadContext__(void);
+
+static inline ExceptionContext *
+currentContext__(void)
+{
+    ExceptionContext *context = exceptionContext__;
+    if (__builtin_expect(!context, 0))
+    {
+        context = threadContext__();
+    }
+
+    return context;
+}
+
+static inline TryFrame__ *
+frameAt__(ExceptionContext *context, unsigned depth)
+{
+    return &context->tryChunks[depth / TRY_CHUNK_SIZE]
+                ->frames[depth % TRY_CHUNK_SIZE];
+}
+
+TryChunk__ *growStack__(ExceptionContext *context, int chunkIndex);
+const char *formatMessage__(void);
+void traceEvent__(int kind);
+noreturn void deferOverflow__(void (*fn)(void *), void *arg);
+void runDeferred__(int depth);
+#ifndef EXCEPTIONS_NO_SOURCE_INFO
+int assignStatsSlot__(TrySite__ *site);
+#endif
+
+// The statistics slot for an exception type
+static inline unsigned
+statsTypeSlot__(int type)
+{
+    return (unsigned)type < MAX_EXCEPTION_TYPES ? (unsigned)type
+                                                : OTHER_EXCEPTION_TYPES;
+}
+
+#ifdef EXCEPTIONS_INLINE
+#define EXCEPTIONS_INLINE_API__ static inline
+#else
+#define EXCEPTIONS_INLINE_API__
+#endif
+
+#ifdef EXCEPTIONS_NO_SOURCE_INFO
+EXCEPTIONS_INLINE_API__ ExceptionJmpBuf__ *try__(void)
+#else
+EXCEPTIONS_INLINE_API__ ExceptionJmpBuf__ *try__(TrySite__ *site)
+#endif
+{
+    ExceptionContext *context = currentContext__();
+    // Unsigned so that the chunk lookup is a shift and a mask
+    unsigned depth = context->depth;
+    if (__builtin_expect(depth >= MAX_TRY_DEPTH, 0))
+    {
+        throw__(CALL_STACK_EXCEEDED_EXCEPTION,
+                "Exceeded the maximum TRY depth");
+    }
+
+    unsigned chunkIndex = depth / TRY_CHUNK_SIZE;
+    TryChunk__ *chunk = context->tryChunks[chunkIndex];
+    if (__builtin_expect(!chunk, 0))
+    {
+        chunk = growStack__(context, chunkIndex);
+    }
+
+    TryFrame__ *frame = &chunk->frames[depth % TRY_CHUNK_SIZE];
+    frame->arenaMark = context->arenaUsed;
+#ifndef EXCEPTIONS_NO_SOURCE_INFO
+    frame->site = site;
+#endif
+
+#ifndef EXCEPTIONS_NO_TRY_STATS
+#ifdef EXCEPTIONS_NO_SOURCE_INFO
+    STATS_ADD__(threadStats__.tryEntries[0]);
+#else
+    int slot = __atomic_load_n(&site->statsSlot, __ATOMIC_RELAXED);
+    if (__builtin_expect(slot < 0, 0))
+    {
+        slot = assignStatsSlot__(site);
+    }
+    STATS_ADD__(threadStats__.tryEntries[slot]);
+#endif
+    if (__builtin_expect(depth >= threadStats__.maxDepth, 0))
+    {
+        __atomic_store_n(&threadStats__.maxDepth, depth + 1, __ATOMIC_RELAXED);
+    }
+#endif
+    context->depth = depth + 1;
+
+    return &frame->buffer;
+}
+
+EXCEPTIONS_INLINE_API__ const char *
+catchMessage__(void)
+{
+    CurrentException__ *exception = &currentContext__()->currentException;
+    if (__builtin_expect(exception->format != NULL, 0))
+    {
+        return formatMessage__();
+    }
+
+    return exception->message;
+}
+
+EXCEPTIONS_INLINE_API__ int
+catchHandled__(void)
+{
+    CurrentException__ *exception = &currentContext__()->currentException;
+    bool oldWasCatchHandled = exception->handled;
+    exception->handled = true;
+    STATS_ADD__(threadStats__.caught[statsTypeSlot__(exception->type)]);
+    if (TRACING__())
+    {
+        traceEvent__(EXCEPTION_TRACE_CATCH);
+    }
+
+    return oldWasCatchHandled;
+}
+
+EXCEPTIONS_INLINE_API__ void
+defer__(void (*fn)(void *), void *arg)
+{
+    ExceptionContext *context = currentContext__();
+    int count = context->deferredCount;
+    if (__builtin_expect(count >= MAX_DEFERRED, 0))
+    {
+        deferOverflow__(fn, arg);
+    }
+
+    context->deferred[count] = (DeferredCleanup__){fn, arg, context->depth};
+    context->deferredCount = count + 1;
+}
+
+EXCEPTIONS_INLINE_API__ void
+endTry__(void)
+{
+    if (TRACING__())
+    {
+        traceEvent__(EXCEPTION_TRACE_FINALLY);
+    }
+
+    ExceptionContext *context = currentContext__();
+    int count = context->deferredCount;
+    if (__builtin_expect(count > 0, 0) &&
+        context->deferred[count - 1].depth >= context->depth)
+    {
+        runDeferred__(context->depth);
+    }
+
+    // Nothing outside this TRY can refer to what was allocated inside it,
+    // unless it is being rethrown, which rethrow__ takes care of
+    unsigned depth = --context->depth;
+    context->arenaUsed = frameAt__(context, depth)->arenaMark;
+}
@@ -21,12 +21,20 @@
  */
 
 #include "exceptions.h"
+#include "exceptions_future.h"
+#include "exceptions_trace.h"
 #include "test_helper.h"
 
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
 
 static bool returnFinallyRan;
 
@@ -200,6 +208,106 @@ TEST("rethrow allows throwing again in a catch block")
     ASSERT(secondCatchHit);
 }
 
+TEST("RETHROW runs the FINALLY block before passing the exception on")
+{
+    volatile bool finallyRan = false;
+    volatile bool finallyRanFirst = false;
+
+    TRY
+    {
+        TRY { THROW(5, "some error"); }
+        CATCH(5) { RETHROW; }
+        FINALLY { finallyRan = true; }
+    }
+    CATCH(5) { finallyRanFirst = finallyRan; }
+
+    ASSERT(finallyRanFirst);
+}
+
+TEST("RETHROW from a CATCH_ALL runs the FINALLY block")
+{
+    volatile int finallyRuns = 0;
+    volatile int caught = 0;
+
+    TRY
+    {
+        TRY { THROW(6, "some error"); }
+        CATCH_ALL(e)
+        {
+            if (e.type == 6)
+            {
+                RETHROW;
+            }
+        }
+        FINALLY { finallyRuns++; }
+    }
+    CATCH_ALL(e) { caught = e.type; }
+
+    ASSERT_EQUAL(finallyRuns, 1);
+    ASSERT_EQUAL(caught, 6);
+}
+
+TEST("The rest of the CATCH block is skipped after a RETHROW")
+{
+    volatile bool afterRethrow = false;
+
+    TRY
+    {
+        TRY { THROW(5, "some error"); }
+        CATCH(5)
+        {
+            RETHROW;
+            afterRethrow = true;
+        }
+    }
+    CATCH(5) {}
+
+    ASSERT(!afterRethrow);
+}
+
+TEST("A TRY in the FINALLY block doesn't lose a RETHROWn exception")
+{
+    volatile int caught = 0;
+
+    TRY
+    {
+        TRY { THROW(5, "the original exception"); }
+        CATCH(5) { RETHROW; }
+        FINALLY
+        {
+            TRY { THROW(6, "caught inside the FINALLY"); }
+            CATCH(6) {}
+        }
+    }
+    CATCH_ALL(e) { caught = e.type; }
+
+    ASSERT_EQUAL(caught, 5);
+}
+
+TEST("A TRY in the FINALLY block doesn't lose an uncaught exception")
+{
+    volatile int caught = 0;
+    const char *volatile message = NULL;
+
+    TRY
+    {
+        TRY { THROW(5, "the original exception"); }
+        FINALLY
+        {
+            TRY { THROW(6, "caught inside the FINALLY"); }
+            CATCH(6) {}
+        }
+    }
+    CATCH_ALL(e)
+    {
+        caught = e.type;
+        message = e.message;
+    }
+
+    ASSERT_EQUAL(caught, 5);
+    ASSERT_EQUAL(strcmp(message, "the original exception"), 0);
+}
+
 TEST("TRY is allowed on its own")
 {
     volatile bool tryCalled = false;
@@ -326,3 +434,1252 @@ TEST("Method inside the return statement which throw work as expected")
     ASSERT_EQUAL(methodInReturnThrowsAnExceptionAndThenReturn5(), 5);
     ASSERT(returnFinallyRan);
 }
+
+static void *
+throwAndCatchManyTimes(void *arg)
+{
+    int type = *(int *)arg;
+    volatile int caught = 0;
+
+    for (int i = 0; i < 10000; i++)
+    {
+        TRY
+        {
+            TRY { throwException(type); }
+            FINALLY {}
+        }
+        CATCH_ALL(e)
+        {
+            if (e.type == type)
+            {
+                caught++;
+            }
+        }
+    }
+
+    return (void *)(long)caught;
+}
+
+TEST("Each thread has its own exception stack")
+{
+    enum
+    {
+        NUM_THREADS = 4
+    };
+    pthread_t threads[NUM_THREADS];
+    int types[NUM_THREADS];
+
+    TRY
+    {
+        for (int i = 0; i < NUM_THREADS; i++)
+        {
+            types[i] = 100 + i;
+            ASSERT_EQUAL(pthread_create(&threads[i], NULL,
+                                        throwAndCatchManyTimes, &types[i]),
+                         0);
+        }
+
+        for (int i = 0; i < NUM_THREADS; i++)
+        {
+            void *caught;
+            pthread_join(threads[i], &caught);
+            ASSERT_EQUAL((long)caught, 10000L);
+        }
+    }
+    FINALLY {}
+}
+
+static void
+nestTriesThenThrow(int depth)
+{
+    if (depth == 0)
+    {
+        throwException(77);
+    }
+
+    TRY { nestTriesThenThrow(depth - 1); }
+    CATCH(78) { ASSERT(false); }
+}
+
+TEST("TRY blocks can be nested across many stack chunks")
+{
+    volatile bool caught = false;
+
+    TRY { nestTriesThenThrow(200); }
+    CATCH(77) { caught = true; }
+
+    ASSERT(caught);
+}
+
+static volatile int deepestTry;
+
+static void
+nestTriesForever(int depth)
+{
+    deepestTry = depth;
+    TRY { nestTriesForever(depth + 1); }
+    FINALLY {}
+}
+
+TEST("Nesting TRY blocks too deeply throws CALL_STACK_EXCEEDED_EXCEPTION")
+{
+    volatile bool caught = false;
+
+    TRY { nestTriesForever(0); }
+    CATCH(CALL_STACK_EXCEEDED_EXCEPTION) { caught = true; }
+
+    ASSERT(caught);
+    ASSERT(deepestTry > 100);
+}
+
+TEST("THROWF formats the message")
+{
+    volatile Exception caught = {.type = 0};
+
+    TRY { THROWF(12, "request %d failed at offset %s", 42, "0x10"); }
+    CATCH_ALL(e) { caught = e; }
+
+    ASSERT_EQUAL(caught.type, 12);
+    ASSERT_EQUAL(strcmp(caught.message, "request 42 failed at offset 0x10"),
+                 0);
+}
+
+TEST("THROWF supports the usual printf conversions")
+{
+    volatile Exception caught = {.type = 0};
+
+    TRY
+    {
+        THROWF(12, "%5.2f|%-4d|%#x|%c|%*d|%lu|%%|%s|%i", 3.14159, 7, 255u,
+               'a', 3, 5, 10UL, "end", -1);
+    }
+    CATCH_ALL(e) { caught = e; }
+
+    ASSERT_EQUAL(strcmp(caught.message, " 3.14|7   |0xff|a|  5|10|%|end|-1"),
+                 0);
+}
+
+// 58 zero flags leave room for only the sign of the * width. It isn't a
+// literal, so that the compiler doesn't object to the repeated flags.
+static const char *longSpec =
+    "%0000000000000000000000000000000000000000000000000000000000*d";
+
+TEST("THROWF drops the parts of a conversion which are too long to keep")
+{
+    volatile Exception caught = {.type = 0};
+
+    TRY { THROWF(12, longSpec, -2000000000, 5); }
+    CATCH_ALL(e) { caught = e; }
+
+    ASSERT_EQUAL(caught.type, 12);
+    ASSERT_EQUAL(strcmp(caught.message, "5"), 0);
+}
+
+static void
+throwWithStackString(void)
+{
+    char name[16];
+    snprintf(name, sizeof(name), "widget-%d", 3);
+    THROWF(12, "could not find %s", name);
+}
+
+TEST("THROWF copies string arguments")
+{
+    volatile Exception caught = {.type = 0};
+
+    TRY { throwWithStackString(); }
+    CATCH(12)
+    {
+        // Reuse the stack that the string was on before reading the message
+        char scratch[64];
+        memset(scratch, 'x', sizeof(scratch));
+        (void)scratch;
+        caught.message = catchMessage__();
+    }
+
+    ASSERT_EQUAL(strcmp(caught.message, "could not find widget-3"), 0);
+}
+
+static void *
+throwFormattedThroughFinally(void *arg)
+{
+    (void)arg;
+    TRY
+    {
+        THROWF(12, "value %d and %s and %d", 123456, "abcdefghijklmnop",
+               987654);
+    }
+    FINALLY {}
+    return NULL;
+}
+
+TEST("An unhandled THROWF prints the whole formatted message")
+{
+    int output[2];
+    ASSERT_EQUAL(pipe(output), 0);
+
+    pid_t child = fork();
+    ASSERT(child >= 0);
+    if (child == 0)
+    {
+        // The main thread is inside the test runner's TRY, so throw on a
+        // thread with no TRY blocks around the one which lets it through
+        dup2(output[1], STDERR_FILENO);
+        pthread_t thread;
+        pthread_create(&thread, NULL, throwFormattedThroughFinally, NULL);
+        pthread_join(thread, NULL);
+        _exit(0);
+    }
+
+    close(output[1]);
+    char message[256];
+    size_t length = 0;
+    ssize_t got;
+    while (length < sizeof(message) - 1 &&
+           (got = read(output[0], message + length,
+                       sizeof(message) - 1 - length)) > 0)
+    {
+        length += got;
+    }
+    message[length] = '\0';
+    close(output[0]);
+
+    int status;
+    ASSERT_EQUAL(waitpid(child, &status, 0), child);
+    ASSERT(WIFEXITED(status));
+    ASSERT_EQUAL(WEXITSTATUS(status), 1);
+    ASSERT(strstr(message, "value 123456 and abcdefghijklmnop and 987654"));
+}
+
+typedef struct
+{
+    int requestId;
+    long offset;
+} ParseError;
+
+TEST("THROW_PAYLOAD attaches a copy of the payload")
+{
+    volatile int requestId = 0;
+    volatile long offset = 0;
+    volatile bool wrongTypeIsNull = false;
+
+    TRY
+    {
+        ParseError error = {.requestId = 7, .offset = 1234};
+        THROW_PAYLOAD(13, "parse error", error);
+    }
+    CATCH_ALL(e)
+    {
+        const ParseError *error = EXCEPTION_PAYLOAD(e, ParseError);
+        requestId = error->requestId;
+        offset = error->offset;
+        wrongTypeIsNull = EXCEPTION_PAYLOAD(e, char) == NULL;
+    }
+
+    ASSERT_EQUAL(requestId, 7);
+    ASSERT_EQUAL(offset, 1234L);
+    ASSERT(wrongTypeIsNull);
+}
+
+TEST("Exceptions thrown with THROW have no payload")
+{
+    volatile bool hasPayload = true;
+
+    TRY { THROW(14, "no payload"); }
+    CATCH_ALL(e) { hasPayload = e.payload != NULL; }
+
+    ASSERT(!hasPayload);
+}
+
+// Whether a THROWF and a THROW_PAYLOAD both still fit in the arena
+static bool
+throwFormattedAndPayload(int i)
+{
+    char expected[64];
+    volatile bool matched = false;
+    volatile bool hadPayload = false;
+    snprintf(expected, sizeof(expected), "formatted exception %d", i);
+
+    TRY { THROWF(15, "formatted exception %d", i); }
+    CATCH_ALL(e) { matched = strcmp(e.message, expected) == 0; }
+
+    TRY { THROW_PAYLOAD(15, "with a payload", i); }
+    CATCH_ALL(e) { hadPayload = e.payload != NULL; }
+
+    return matched && hadPayload;
+}
+
+TEST("Each TRY gives back the arena it used when it finishes")
+{
+    volatile int failures = 0;
+
+    // Every test is already inside a TRY, but make sure of an enclosing one
+    TRY
+    {
+        for (int i = 0; i < 10000; i++)
+        {
+            if (!throwFormattedAndPayload(i))
+            {
+                failures++;
+            }
+        }
+    }
+
+    ASSERT_EQUAL(failures, 0);
+}
+
+enum
+{
+    IO_EXCEPTION = 100,
+    FILE_EXCEPTION,
+    FILE_NOT_FOUND_EXCEPTION,
+    NETWORK_EXCEPTION,
+};
+
+static void
+registerIoExceptions(void)
+{
+    ASSERT_EQUAL(registerExceptionType(IO_EXCEPTION, 0), 0);
+    ASSERT_EQUAL(registerExceptionType(FILE_EXCEPTION, IO_EXCEPTION), 0);
+    ASSERT_EQUAL(
+        registerExceptionType(FILE_NOT_FOUND_EXCEPTION, FILE_EXCEPTION), 0);
+    ASSERT_EQUAL(registerExceptionType(NETWORK_EXCEPTION, IO_EXCEPTION), 0);
+}
+
+TEST("CATCH of a base type catches all of its descendants")
+{
+    registerIoExceptions();
+    volatile int caughtBy = 0;
+
+    TRY { THROW(FILE_NOT_FOUND_EXCEPTION, "missing"); }
+    CATCH(NETWORK_EXCEPTION) { caughtBy = NETWORK_EXCEPTION; }
+    CATCH(IO_EXCEPTION) { caughtBy = IO_EXCEPTION; }
+
+    ASSERT_EQUAL(caughtBy, IO_EXCEPTION);
+
+    TRY { THROW(FILE_NOT_FOUND_EXCEPTION, "missing"); }
+    CATCH(FILE_EXCEPTION) { caughtBy = FILE_EXCEPTION; }
+    CATCH(IO_EXCEPTION) { caughtBy = IO_EXCEPTION; }
+
+    ASSERT_EQUAL(caughtBy, FILE_EXCEPTION);
+}
+
+TEST("CATCH of a derived type doesn't catch its parent or siblings")
+{
+    registerIoExceptions();
+    volatile int caughtBy = 0;
+
+    TRY
+    {
+        TRY { THROW(NETWORK_EXCEPTION, "connection reset"); }
+        CATCH(FILE_EXCEPTION) { caughtBy = FILE_EXCEPTION; }
+        CATCH(OUT_OF_RANGE_EXCEPTION) { caughtBy = OUT_OF_RANGE_EXCEPTION; }
+    }
+    CATCH(NETWORK_EXCEPTION) { caughtBy = NETWORK_EXCEPTION; }
+
+    ASSERT_EQUAL(caughtBy, NETWORK_EXCEPTION);
+
+    TRY { THROW(IO_EXCEPTION, "io"); }
+    CATCH(FILE_EXCEPTION) { caughtBy = FILE_EXCEPTION; }
+    CATCH_ALL(e) { caughtBy = e.type; }
+
+    ASSERT_EQUAL(caughtBy, IO_EXCEPTION);
+}
+
+TEST("Invalid exception type registrations are rejected")
+{
+    registerIoExceptions();
+
+    ASSERT_EQUAL(registerExceptionType(FILE_EXCEPTION, NETWORK_EXCEPTION), -1);
+    ASSERT_EQUAL(registerExceptionType(110, 109), -1);
+    ASSERT_EQUAL(registerExceptionType(110, 110), -1);
+    ASSERT_EQUAL(registerExceptionType(MAX_EXCEPTION_TYPES, 0), -1);
+    ASSERT_EQUAL(registerExceptionType(0, IO_EXCEPTION), -1);
+}
+
+// Not static, so that -rdynamic exports it and backtraces can name it
+__attribute__((noipa)) void
+throwForBacktrace(void)
+{
+    THROW(16, "with a backtrace");
+}
+
+// Whether the innermost frame of e's backtrace is in the named function. This
+// goes by the symbol printExceptionBacktrace finds rather than the address,
+// since there's no telling how big the function's code is, e.g. when built
+// with sanitizers.
+static bool
+backtraceStartsIn(const Exception *e, const char *function)
+{
+    int fds[2];
+    if (e->backtraceLength < 1 || pipe(fds) != 0)
+    {
+        return false;
+    }
+
+    Exception innermost = *e;
+    innermost.backtraceLength = 1;
+    printExceptionBacktrace(&innermost, fds[1]);
+    close(fds[1]);
+
+    char line[1024];
+    ssize_t length = read(fds[0], line, sizeof(line) - 1);
+    close(fds[0]);
+    if (length <= 0)
+    {
+        return false;
+    }
+    line[length] = '\0';
+
+    // Each line looks like ./exceptions_test(function+0x1c) [0x...]
+    char symbol[128];
+    snprintf(symbol, sizeof(symbol), "(%s+", function);
+    return strstr(line, symbol) != NULL;
+}
+
+TEST("Backtraces are only recorded when enabled")
+{
+    volatile int backtraceLength = -1;
+
+    TRY { throwForBacktrace(); }
+    CATCH_ALL(e) { backtraceLength = e.backtraceLength; }
+
+    ASSERT_EQUAL(backtraceLength, 0);
+}
+
+TEST("Backtraces start from the function which threw")
+{
+    volatile int backtraceLength = 0;
+    volatile bool startsInThrower = false;
+
+    setExceptionBacktraces(1);
+    TRY { throwForBacktrace(); }
+    CATCH_ALL(e)
+    {
+        backtraceLength = e.backtraceLength;
+        startsInThrower = backtraceStartsIn((const Exception *)&e,
+                                            "throwForBacktrace");
+    }
+    setExceptionBacktraces(0);
+
+    ASSERT(backtraceLength > 1);
+    ASSERT(startsInThrower);
+}
+
+TEST("RETHROW keeps the original backtrace")
+{
+    volatile bool startsInThrower = false;
+
+    setExceptionBacktraces(1);
+    TRY
+    {
+        TRY { throwForBacktrace(); }
+        CATCH(16) { RETHROW; }
+    }
+    CATCH_ALL(e)
+    {
+        startsInThrower = backtraceStartsIn((const Exception *)&e,
+                                            "throwForBacktrace");
+    }
+    setExceptionBacktraces(0);
+
+    ASSERT(startsInThrower);
+}
+
+TEST("printExceptionBacktrace writes a line per frame")
+{
+    int fds[2];
+    ASSERT_EQUAL(pipe(fds), 0);
+    volatile int backtraceLength = 0;
+
+    setExceptionBacktraces(1);
+    TRY { throwForBacktrace(); }
+    CATCH_ALL(e)
+    {
+        backtraceLength = e.backtraceLength;
+        printExceptionBacktrace((const Exception *)&e, fds[1]);
+    }
+    setExceptionBacktraces(0);
+    close(fds[1]);
+
+    char output[8192];
+    ssize_t length = read(fds[0], output, sizeof(output) - 1);
+    close(fds[0]);
+    ASSERT(length > 0);
+    output[length] = '\0';
+
+    int lines = 0;
+    for (char *c = output; *c; c++)
+    {
+        lines += *c == '\n';
+    }
+    ASSERT_EQUAL(lines, backtraceLength);
+}
+
+// Too big to comfortably put on the stack
+static ExceptionStats statsBefore;
+static ExceptionStats statsAfter;
+
+TEST("Exception statistics count throws, catches and TRY entries")
+{
+    getExceptionStats(&statsBefore);
+
+    const int tryLine = __LINE__ + 3;
+    for (int i = 0; i < 3; i++)
+    {
+        TRY { THROW(17, "counted"); }
+        CATCH(17) {}
+    }
+
+    getExceptionStats(&statsAfter);
+
+    ASSERT_EQUAL((long)(statsAfter.thrown[17] - statsBefore.thrown[17]), 3L);
+    ASSERT_EQUAL((long)(statsAfter.caught[17] - statsBefore.caught[17]), 3L);
+
+#if defined(EXCEPTIONS_NO_SOURCE_INFO) || defined(EXCEPTIONS_NO_TRY_STATS)
+    (void)tryLine;
+#else
+    volatile long entries = -1;
+    for (int i = 1; i < statsAfter.siteCount; i++)
+    {
+        if (statsAfter.sites[i].lineNumber == tryLine &&
+            strcmp(statsAfter.sites[i].fileName, __FILE__) == 0)
+        {
+            entries = statsAfter.sites[i].entries;
+        }
+    }
+    ASSERT_EQUAL((long)entries, 3L);
+#endif
+}
+
+static void
+nestTriesThenRethrow(int depth)
+{
+    if (depth == 0)
+    {
+        THROW(17, "counted");
+    }
+
+    TRY { nestTriesThenRethrow(depth - 1); }
+    CATCH(17) { RETHROW; }
+}
+
+TEST("Exception statistics track rethrows and the deepest TRY")
+{
+    getExceptionStats(&statsBefore);
+
+    TRY { nestTriesThenRethrow(40); }
+    CATCH(17) {}
+
+    getExceptionStats(&statsAfter);
+
+    ASSERT_EQUAL((long)(statsAfter.rethrown - statsBefore.rethrown), 40L);
+#ifndef EXCEPTIONS_NO_TRY_STATS
+    ASSERT(statsAfter.maxDepth > 40);
+#endif
+}
+
+static void *
+throwOnThread(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < 5; i++)
+    {
+        TRY { THROW(18, "counted"); }
+        CATCH(18) {}
+    }
+
+    return NULL;
+}
+
+TEST("Exception statistics include threads which have exited")
+{
+    getExceptionStats(&statsBefore);
+
+    pthread_t thread;
+    ASSERT_EQUAL(pthread_create(&thread, NULL, throwOnThread, NULL), 0);
+    pthread_join(thread, NULL);
+
+    getExceptionStats(&statsAfter);
+
+    ASSERT_EQUAL((long)(statsAfter.thrown[18] - statsBefore.thrown[18]), 5L);
+    ASSERT_EQUAL((long)(statsAfter.caught[18] - statsBefore.caught[18]), 5L);
+}
+
+TEST("Tracing records throws, catches and FINALLYs to the dump")
+{
+    const int tryLine = __LINE__ + 2;
+    setExceptionTracing(1);
+    TRY { THROW(19, "traced"); }
+    CATCH(19) {}
+    setExceptionTracing(0);
+
+    FILE *file = tmpfile();
+    ASSERT(file != NULL);
+    ASSERT_EQUAL(dumpExceptionTrace(fileno(file)), 0);
+    rewind(file);
+
+    ExceptionTraceHeader header;
+    ASSERT_EQUAL(fread(&header, sizeof(header), 1, file), 1UL);
+    ASSERT_EQUAL(memcmp(header.magic, EXCEPTION_TRACE_MAGIC, 8), 0);
+    ASSERT(header.ticksPerSecond > 0);
+    ExceptionTraceSite sites[header.siteCount];
+    ASSERT_EQUAL(fread(sites, sizeof(sites[0]), header.siteCount, file),
+                 (unsigned long)header.siteCount);
+
+    // This thread's events should end with the throw, catch and FINALLY
+    volatile bool found = false;
+    for (uint32_t i = 0; i < header.threadCount; i++)
+    {
+        ExceptionTraceThread thread;
+        ASSERT_EQUAL(fread(&thread, sizeof(thread), 1, file), 1UL);
+        ExceptionTraceEvent events[thread.eventCount + 1];
+        ASSERT_EQUAL(fread(events, sizeof(events[0]), thread.eventCount, file),
+                     (unsigned long)thread.eventCount);
+
+        for (uint32_t j = 0; j + 3 <= thread.eventCount; j++)
+        {
+            ExceptionTraceEvent *e = &events[j];
+            if (EXCEPTION_TRACE_KIND(e[0]) == EXCEPTION_TRACE_THROW &&
+                e[0].type == 19 &&
+                EXCEPTION_TRACE_KIND(e[1]) == EXCEPTION_TRACE_CATCH &&
+                e[1].type == 19 &&
+                EXCEPTION_TRACE_KIND(e[2]) == EXCEPTION_TRACE_FINALLY &&
+                EXCEPTION_TRACE_DEPTH(e[0]) ==
+                    EXCEPTION_TRACE_DEPTH(e[2]) &&
+                e[0].timestamp <= e[2].timestamp)
+            {
+#ifdef EXCEPTIONS_NO_SOURCE_INFO
+                (void)tryLine;
+                found = true;
+#else
+                found = e[0].site < header.siteCount &&
+                        sites[e[0].site].lineNumber == tryLine;
+#endif
+            }
+        }
+    }
+    fclose(file);
+
+    ASSERT(found);
+}
+
+static int *volatile nullPointer = NULL;
+
+TEST("Segmentation faults can be caught once signal exceptions are enabled")
+{
+    ASSERT_EQUAL(enableSignalExceptions(), 0);
+    volatile int caught = 0;
+
+    // Catching it more than once makes sure the signal is unblocked again
+    for (int i = 0; i < 3; i++)
+    {
+        TRY { *nullPointer = 1; }
+        CATCH(SEGMENTATION_FAULT_EXCEPTION) { caught++; }
+    }
+
+    ASSERT_EQUAL(caught, 3);
+}
+
+static volatile int zero = 0;
+static volatile int seven = 7;
+
+TEST("Floating point exceptions can be caught")
+{
+    ASSERT_EQUAL(enableSignalExceptions(), 0);
+    volatile int caught = 0;
+
+    TRY
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        // Integer division by zero only traps on some architectures
+        zero = seven / zero;
+#else
+        raise(SIGFPE);
+#endif
+    }
+    CATCH(FLOATING_POINT_EXCEPTION) { caught++; }
+
+    TRY { raise(SIGBUS); }
+    CATCH(BUS_ERROR_EXCEPTION) { caught++; }
+
+    ASSERT_EQUAL(caught, 2);
+}
+
+static volatile bool keepRecursing = true;
+
+__attribute__((noipa)) static int
+recurseForever(int depth)
+{
+    volatile char padding[1024];
+    padding[0] = depth;
+    if (!keepRecursing)
+    {
+        return 0;
+    }
+    return recurseForever(depth + 1) + padding[0];
+}
+
+static void *
+overflowStack(void *arg)
+{
+    (void)arg;
+    volatile bool caught = false;
+
+    TRY { recurseForever(0); }
+    CATCH(SEGMENTATION_FAULT_EXCEPTION) { caught = true; }
+
+    return (void *)caught;
+}
+
+TEST("Stack overflows can be caught on threads created after enabling")
+{
+    ASSERT_EQUAL(enableSignalExceptions(), 0);
+
+    pthread_t thread;
+    void *caught;
+    ASSERT_EQUAL(pthread_create(&thread, NULL, overflowStack, NULL), 0);
+    pthread_join(thread, &caught);
+
+    ASSERT(caught == (void *)true);
+}
+
+static void *
+faultOutsideTry(void *arg)
+{
+    (void)arg;
+    *nullPointer = 1;
+    return NULL;
+}
+
+TEST("Signals outside of any TRY block still get their default action")
+{
+    pid_t child = fork();
+    ASSERT(child >= 0);
+    if (child == 0)
+    {
+        // The main thread is inside the test runner's TRY, so fault on a
+        // thread with no TRY blocks
+        struct rlimit noCoreDumps = {0, 0};
+        setrlimit(RLIMIT_CORE, &noCoreDumps);
+        enableSignalExceptions();
+
+        pthread_t thread;
+        pthread_create(&thread, NULL, faultOutsideTry, NULL);
+        pthread_join(thread, NULL);
+        _exit(0);
+    }
+
+    int status;
+    ASSERT_EQUAL(waitpid(child, &status, 0), child);
+    ASSERT(WIFSIGNALED(status));
+    ASSERT_EQUAL(WTERMSIG(status), SIGSEGV);
+}
+
+// Records the order that things happen in, e.g. "12c" for two cleanups then
+// a catch
+static char events[16];
+static int eventCount;
+
+static void
+recordEvent(void *event)
+{
+    events[eventCount++] = (char)(size_t)event;
+    events[eventCount] = '\0';
+}
+
+SETUP()
+{
+    eventCount = 0;
+    events[0] = '\0';
+}
+
+TEST("DEFERred cleanups run in reverse order after the FINALLY block")
+{
+    TRY
+    {
+        DEFER(recordEvent, (void *)'1');
+        DEFER(recordEvent, (void *)'2');
+        recordEvent((void *)'t');
+    }
+    FINALLY { recordEvent((void *)'f'); }
+
+    ASSERT_EQUAL(strcmp(events, "tf21"), 0);
+}
+
+static void
+openTwoResourcesThenThrow(void)
+{
+    DEFER(recordEvent, (void *)'1');
+    DEFER(recordEvent, (void *)'2');
+    THROW(20, "failed after opening two resources");
+}
+
+TEST("DEFERred cleanups run before the CATCH when an exception is thrown")
+{
+    TRY { openTwoResourcesThenThrow(); }
+    CATCH(20) { recordEvent((void *)'c'); }
+    FINALLY { recordEvent((void *)'f'); }
+
+    ASSERT_EQUAL(strcmp(events, "21cf"), 0);
+}
+
+TEST("DEFERred cleanups only run when their own TRY block is left")
+{
+    TRY
+    {
+        DEFER(recordEvent, (void *)'o');
+        TRY { openTwoResourcesThenThrow(); }
+        FINALLY { recordEvent((void *)'f'); }
+    }
+    CATCH(20) { recordEvent((void *)'c'); }
+
+    ASSERT_EQUAL(strcmp(events, "21foc"), 0);
+}
+
+static int
+returnWithDeferred(void)
+{
+    TRY
+    {
+        DEFER(recordEvent, (void *)'1');
+        RETURN(5);
+    }
+
+    return 0;
+}
+
+TEST("DEFERred cleanups run when RETURNing out of a TRY block")
+{
+    ASSERT_EQUAL(returnWithDeferred(), 5);
+    ASSERT_EQUAL(strcmp(events, "1"), 0);
+}
+
+static void
+throwInCleanup(void *arg)
+{
+    (void)arg;
+    TRY { THROW(21, "caught inside the cleanup"); }
+    CATCH(21) {}
+}
+
+TEST("A cleanup which uses TRY doesn't replace the exception in flight")
+{
+    volatile int caught = 0;
+
+    TRY
+    {
+        DEFER(throwInCleanup, NULL);
+        THROW(20, "the original exception");
+    }
+    CATCH_ALL(e) { caught = e.type; }
+
+    ASSERT_EQUAL(caught, 20);
+}
+
+static int cleanupsRun;
+
+static void
+countCleanup(void *arg)
+{
+    (void)arg;
+    cleanupsRun++;
+}
+
+TEST("Too many DEFERs throws, after running every cleanup")
+{
+    volatile bool caught = false;
+    cleanupsRun = 0;
+
+    TRY
+    {
+        for (int i = 0; i < MAX_DEFERRED + 1; i++)
+        {
+            DEFER(countCleanup, NULL);
+        }
+    }
+    CATCH(CALL_STACK_EXCEEDED_EXCEPTION) { caught = true; }
+
+    ASSERT(caught);
+    ASSERT_EQUAL(cleanupsRun, MAX_DEFERRED + 1);
+}
+
+static int
+returnFromNestedTries(void)
+{
+    TRY
+    {
+        TRY
+        {
+            TRY { RETURN(7); }
+            FINALLY { recordEvent((void *)'1'); }
+        }
+        FINALLY { recordEvent((void *)'2'); }
+        recordEvent((void *)'x');
+    }
+    FINALLY { recordEvent((void *)'3'); }
+
+    return 0;
+}
+
+TEST("RETURN runs the FINALLY block of every enclosing TRY")
+{
+    ASSERT_EQUAL(returnFromNestedTries(), 7);
+    ASSERT_EQUAL(strcmp(events, "123"), 0);
+}
+
+static int
+returnFromNestedCatch(void)
+{
+    TRY
+    {
+        TRY { THROW(22, "caught then returned from"); }
+        CATCH(22)
+        {
+            TRY { RETURN(8); }
+            FINALLY { recordEvent((void *)'1'); }
+        }
+        FINALLY { recordEvent((void *)'2'); }
+    }
+    CATCH(22) { recordEvent((void *)'x'); }
+    FINALLY { recordEvent((void *)'3'); }
+
+    return 0;
+}
+
+TEST("RETURN from a TRY inside a CATCH unwinds every TRY")
+{
+    ASSERT_EQUAL(returnFromNestedCatch(), 8);
+    ASSERT_EQUAL(strcmp(events, "123"), 0);
+}
+
+static int
+returnFromFinally(void)
+{
+    TRY
+    {
+        TRY { recordEvent((void *)'t'); }
+        FINALLY
+        {
+            recordEvent((void *)'f');
+            RETURN(9);
+        }
+    }
+    FINALLY { recordEvent((void *)'o'); }
+
+    return 0;
+}
+
+TEST("RETURN within a FINALLY block doesn't run it again")
+{
+    ASSERT_EQUAL(returnFromFinally(), 9);
+    ASSERT_EQUAL(strcmp(events, "tfo"), 0);
+}
+
+static int
+returnFromFinallyWhileThrowing(void)
+{
+    TRY
+    {
+        TRY { THROW(22, "not caught here"); }
+        FINALLY
+        {
+            recordEvent((void *)'f');
+            RETURN(9);
+        }
+    }
+    FINALLY { recordEvent((void *)'o'); }
+
+    return 0;
+}
+
+TEST("RETURN within a FINALLY block doesn't swallow an uncaught exception")
+{
+    volatile int returned = -1;
+    volatile int caught = 0;
+
+    TRY { returned = returnFromFinallyWhileThrowing(); }
+    CATCH_ALL(e) { caught = e.type; }
+
+    ASSERT_EQUAL(returned, -1);
+    ASSERT_EQUAL(caught, 22);
+    ASSERT_EQUAL(strcmp(events, "fo"), 0);
+}
+
+static void *
+addOne(void *arg)
+{
+    return (char *)arg + 1;
+}
+
+static void *
+throwParseError(void *arg)
+{
+    (void)arg;
+    ParseError error = {.requestId = 3, .offset = 99};
+    THROW_PAYLOAD(23, "bad request", error);
+}
+
+typedef struct
+{
+    Future *future;
+    void *(*task)(void *);
+} TaskToRun;
+
+static void *
+runTaskOnThread(void *arg)
+{
+    TaskToRun *taskToRun = arg;
+    runTask(taskToRun->future, taskToRun->task, NULL);
+    return NULL;
+}
+
+TEST("Awaiting a future returns the task's result")
+{
+    Future future;
+    initFuture(&future);
+    ASSERT(!isFutureDone(&future));
+
+    runTask(&future, addOne, (void *)41);
+
+    ASSERT(isFutureDone(&future));
+    ASSERT(awaitFuture(&future) == (void *)42);
+    destroyFuture(&future);
+}
+
+TEST("Exceptions which escape a task are thrown by awaitFuture")
+{
+    static Future future;
+    initFuture(&future);
+
+    TaskToRun taskToRun = {&future, throwParseError};
+    pthread_t thread;
+    ASSERT_EQUAL(pthread_create(&thread, NULL, runTaskOnThread, &taskToRun),
+                 0);
+
+    volatile int type = 0;
+    volatile long offset = 0;
+    char message[32] = "";
+
+    // Await before joining, so that this may have to wait for the task
+    TRY { awaitFuture(&future); }
+    CATCH_ALL(e)
+    {
+        type = e.type;
+        snprintf(message, sizeof(message), "%s", e.message);
+        offset = EXCEPTION_PAYLOAD(e, ParseError)->offset;
+    }
+    pthread_join(thread, NULL);
+
+    ASSERT_EQUAL(type, 23);
+    ASSERT_EQUAL(strcmp(message, "bad request"), 0);
+    ASSERT_EQUAL(offset, 99L);
+
+    // The exception is thrown again each time the future is awaited
+    type = 0;
+    TRY { awaitFuture(&future); }
+    CATCH(23) { type = 23; }
+    ASSERT_EQUAL(type, 23);
+
+    destroyFuture(&future);
+}
+
+static Future sharedFuture;
+
+static void *
+awaitSharedFuture(void *arg)
+{
+    (void)arg;
+    return awaitFuture(&sharedFuture);
+}
+
+TEST("Many threads can wait on the same future")
+{
+    initFuture(&sharedFuture);
+
+    pthread_t waiters[4];
+    for (int i = 0; i < 4; i++)
+    {
+        ASSERT_EQUAL(
+            pthread_create(&waiters[i], NULL, awaitSharedFuture, NULL), 0);
+    }
+
+    runTask(&sharedFuture, addOne, (void *)9);
+
+    for (int i = 0; i < 4; i++)
+    {
+        void *result;
+        pthread_join(waiters[i], &result);
+        ASSERT(result == (void *)10);
+    }
+    destroyFuture(&sharedFuture);
+}
+
+TEST("swapExceptionContext returns the context which was in use")
+{
+    ExceptionContext *context = createExceptionContext();
+    ASSERT(context != NULL);
+
+    ExceptionContext *threadContext = swapExceptionContext(context);
+    ASSERT(swapExceptionContext(NULL) == context);
+    ASSERT(swapExceptionContext(threadContext) == threadContext);
+
+    destroyExceptionContext(context);
+}
+
+#define NUM_COROUTINES 2000
+#define COROUTINE_ROUNDS 5
+#define COROUTINE_STACK_SIZE (64 * 1024)
+
+typedef struct
+{
+    ucontext_t context;
+    ExceptionContext *exceptions;
+    int caught;
+    int wrong;
+    bool finished;
+} Coroutine;
+
+static ucontext_t schedulerContext;
+static Coroutine *coroutines;
+static int runningCoroutine;
+
+static void
+yieldCoroutine(void)
+{
+    swapcontext(&coroutines[runningCoroutine].context, &schedulerContext);
+}
+
+// Yields at every level on the way in and out, so that the other coroutines
+// run while this one is part way through its TRY blocks
+static void
+throwFromNestedTry(int id, int round, int levels)
+{
+    if (levels == 0)
+    {
+        yieldCoroutine();
+        THROWF(100 + id % 50, "coroutine %d round %d", id, round);
+    }
+
+    TRY
+    {
+        yieldCoroutine();
+        throwFromNestedTry(id, round, levels - 1);
+    }
+    FINALLY { yieldCoroutine(); }
+}
+
+static void
+runCoroutineRound(Coroutine *self, int id, int round)
+{
+    char expected[32];
+    snprintf(expected, sizeof(expected), "coroutine %d round %d", id, round);
+
+    TRY { throwFromNestedTry(id, round, id % 4); }
+    CATCH_ALL(e)
+    {
+        // The message lives in this coroutine's arena, so it must survive
+        // the others throwing in the meantime
+        yieldCoroutine();
+        if (e.type == 100 + id % 50 && strcmp(e.message, expected) == 0)
+        {
+            self->caught++;
+        }
+        else
+        {
+            self->wrong++;
+        }
+    }
+    FINALLY { yieldCoroutine(); }
+}
+
+static void
+runCoroutine(int id)
+{
+    Coroutine *self = &coroutines[id];
+
+    for (int round = 0; round < COROUTINE_ROUNDS; round++)
+    {
+        runCoroutineRound(self, id, round);
+    }
+
+    self->finished = true;
+}
+
+TEST("Coroutines with their own exception contexts can yield inside TRY")
+{
+    coroutines = calloc(NUM_COROUTINES, sizeof(Coroutine));
+    ASSERT(coroutines != NULL);
+
+    for (int i = 0; i < NUM_COROUTINES; i++)
+    {
+        Coroutine *coroutine = &coroutines[i];
+        coroutine->exceptions = createExceptionContext();
+        ASSERT(coroutine->exceptions != NULL);
+
+        getcontext(&coroutine->context);
+        coroutine->context.uc_stack.ss_sp = malloc(COROUTINE_STACK_SIZE);
+        coroutine->context.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+        coroutine->context.uc_link = &schedulerContext;
+        ASSERT(coroutine->context.uc_stack.ss_sp != NULL);
+        makecontext(&coroutine->context, (void (*)(void))runCoroutine, 1, i);
+    }
+
+    // Round robin, so that every coroutine is suspended at a different point
+    // in its TRY blocks whenever another one runs
+    int running = NUM_COROUTINES;
+    while (running > 0)
+    {
+        for (int i = 0; i < NUM_COROUTINES; i++)
+        {
+            Coroutine *coroutine = &coroutines[i];
+            if (coroutine->finished)
+            {
+                continue;
+            }
+
+            runningCoroutine = i;
+            ExceptionContext *threadContext =
+                swapExceptionContext(coroutine->exceptions);
+            swapcontext(&schedulerContext, &coroutine->context);
+            swapExceptionContext(threadContext);
+
+            running -= coroutine->finished;
+        }
+    }
+
+    for (int i = 0; i < NUM_COROUTINES; i++)
+    {
+        ASSERT_EQUAL(coroutines[i].caught, COROUTINE_ROUNDS);
+        ASSERT_EQUAL(coroutines[i].wrong, 0);
+        destroyExceptionContext(coroutines[i].exceptions);
+        free(coroutines[i].context.uc_stack.ss_sp);
+    }
+    free(coroutines);
+}
+
+BENCHMARK("TRY without a throw")
+{
+    int entered = 0;
+    TRY { entered++; }
+    DO_NOT_OPTIMISE(entered);
+}
+
+BENCHMARK("THROW caught by the enclosing TRY")
+{
+    int caught = 0;
+    TRY { throwException(5); }
+    CATCH(5) { caught++; }
+    DO_NOT_OPTIMISE(caught);
+}
+
+// Times capturing the arguments into the arena. This relies on each TRY giving
+// back its part of the arena, since the benchmark runs inside another TRY and
+// would otherwise soon be timing the fallback to the bare format string.
+BENCHMARK("THROWF caught without reading the message")
+{
+    int caught = 0;
+    TRY { THROWF(5, "index %d out of range", 42); }
+    CATCH(5) { caught++; }
+    DO_NOT_OPTIMISE(caught);
+}
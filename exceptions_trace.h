@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2020 Gwilym Kuiper <gw@ilym.me>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file exceptions_trace.h
+ * @brief The format of the exception trace written by dumpExceptionTrace
+ *
+ * A dump is an ExceptionTraceHeader, then siteCount ExceptionTraceSites
+ * (indexed by the site in each event), then threadCount blocks of an
+ * ExceptionTraceThread followed by its events, oldest first. Everything is
+ * in the byte order of the machine which wrote it.
+ *
+ * exceptions_trace_decode turns a dump into text.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define EXCEPTION_TRACE_MAGIC "EXTRACE1"
+
+// What happened in an event
+enum
+{
+    EXCEPTION_TRACE_THROW,   /** An exception was thrown */
+    EXCEPTION_TRACE_CATCH,   /** A CATCH or CATCH_ALL caught it */
+    EXCEPTION_TRACE_RETHROW, /** RETHROW was used */
+    EXCEPTION_TRACE_FINALLY, /** A TRY block finished its FINALLY pass */
+};
+
+/**
+ * A single event, small enough to be recorded with a single store.
+ */
+typedef struct
+{
+    /** When it happened, in ticks (see ExceptionTraceHeader) */
+    uint64_t timestamp;
+    /** The exception type, or 0 for FINALLY events */
+    int32_t type;
+    /** The TRY site (the innermost TRY at the time) */
+    uint16_t site;
+    /** The TRY depth shifted left by 3, ored with the kind of event */
+    uint16_t depthAndKind;
+} __attribute__((aligned(16))) ExceptionTraceEvent;
+
+#define EXCEPTION_TRACE_KIND(event) ((event).depthAndKind & 7)
+#define EXCEPTION_TRACE_DEPTH(event) ((event).depthAndKind >> 3)
+
+typedef struct
+{
+    char magic[8];
+    /** How many timestamp ticks there are in a second */
+    uint64_t ticksPerSecond;
+    uint32_t siteCount;
+    uint32_t threadCount;
+} ExceptionTraceHeader;
+
+typedef struct
+{
+    int32_t lineNumber;
+    /** Truncated if it doesn't fit, empty for site 0 */
+    char fileName[124];
+} ExceptionTraceSite;
+
+typedef struct
+{
+    /** Threads are numbered in the order that they first recorded an event */
+    uint32_t threadIndex;
+    uint32_t eventCount;
+} ExceptionTraceThread;
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2020 Gwilym Kuiper <gw@ilym.me>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Turns a trace written by dumpExceptionTrace into text, one event per line:
+ *
+ *   thread <index> <seconds since the first event> <kind> type=<type>
+ *       depth=<TRY depth> site=<file>:<line>
+ *
+ * Usage: exceptions_trace_decode [trace file]
+ * Reads from stdin if no file is given.
+ */
+
+#include "exceptions_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *const kindNames[] = {
+    [EXCEPTION_TRACE_THROW] = "THROW",
+    [EXCEPTION_TRACE_CATCH] = "CATCH",
+    [EXCEPTION_TRACE_RETHROW] = "RETHROW",
+    [EXCEPTION_TRACE_FINALLY] = "FINALLY",
+};
+
+static void
+readOrDie(void *buffer, size_t size, size_t count, FILE *file)
+{
+    if (fread(buffer, size, count, file) != count)
+    {
+        fprintf(stderr, "Trace is truncated\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    FILE *file = stdin;
+    if (argc > 1 && !(file = fopen(argv[1], "rb")))
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    ExceptionTraceHeader header;
+    readOrDie(&header, sizeof(header), 1, file);
+    if (memcmp(header.magic, EXCEPTION_TRACE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        fprintf(stderr, "Not an exception trace\n");
+        return 1;
+    }
+
+    ExceptionTraceSite *sites = calloc(header.siteCount, sizeof(*sites));
+    readOrDie(sites, sizeof(*sites), header.siteCount, file);
+
+    // Read everything first, so that times can be printed relative to the
+    // earliest event in the whole trace
+    ExceptionTraceThread *threads =
+        calloc(header.threadCount, sizeof(*threads));
+    ExceptionTraceEvent **events = calloc(header.threadCount, sizeof(*events));
+    uint64_t firstTimestamp = UINT64_MAX;
+    for (uint32_t i = 0; i < header.threadCount; i++)
+    {
+        readOrDie(&threads[i], sizeof(threads[i]), 1, file);
+        events[i] = calloc(threads[i].eventCount, sizeof(**events));
+        readOrDie(events[i], sizeof(**events), threads[i].eventCount, file);
+
+        if (threads[i].eventCount > 0 && events[i][0].timestamp < firstTimestamp)
+        {
+            firstTimestamp = events[i][0].timestamp;
+        }
+    }
+
+    for (uint32_t i = 0; i < header.threadCount; i++)
+    {
+        for (uint32_t j = 0; j < threads[i].eventCount; j++)
+        {
+            const ExceptionTraceEvent *event = &events[i][j];
+            unsigned kind = EXCEPTION_TRACE_KIND(*event);
+            const ExceptionTraceSite *site =
+                event->site < header.siteCount ? &sites[event->site] : NULL;
+
+            printf("thread %u %.9f %s type=%d depth=%d site=",
+                   threads[i].threadIndex,
+                   (double)(event->timestamp - firstTimestamp) /
+                       header.ticksPerSecond,
+                   kind < sizeof(kindNames) / sizeof(kindNames[0])
+                       ? kindNames[kind]
+                       : "UNKNOWN",
+                   event->type, EXCEPTION_TRACE_DEPTH(*event));
+            if (site && site->fileName[0])
+            {
+                printf("%s:%d\n", site->fileName, site->lineNumber);
+            }
+            else
+            {
+                printf("<unknown>\n");
+            }
+        }
+        free(events[i]);
+    }
+
+    free(events);
+    free(threads);
+    free(sites);
+    return 0;
+}
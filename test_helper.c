@@ -24,29 +24,54 @@
 #include "exceptions.h"
 #include "test_helper.h"
 
-// For asprintf
+// For asprintf and open_memstream
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #define ASSERTION_FAILED_EXCEPTION (INT32_MAX - 3)
 
-typedef struct Test
+typedef TestDescriptor__ Test;
+
+// The bounds of each kind's section. They are weak so that a kind with
+// nothing declared (and so no section) is just empty.
+#define TEST_SECTION_BOUNDS(kind)                                      \
+    extern const Test __start_test_##kind[] __attribute__((weak));      \
+    extern const Test __stop_test_##kind[] __attribute__((weak))
+
+TEST_SECTION_BOUNDS(Test);
+TEST_SECTION_BOUNDS(Setup);
+TEST_SECTION_BOUNDS(Teardown);
+TEST_SECTION_BOUNDS(Benchmark);
+
+typedef struct
 {
-    const char *name;
-    int expectedException;
-    testFunc__ test;
-    struct Test *next;
-} Test;
+    const Test **items;
+    int count;
+} TestList;
 
-static Test *tests;
-static Test *setups;
-static Test *teardowns;
+static TestList tests;
+static TestList setups;
+static TestList teardowns;
+static TestList benchmarks;
 
 static const char *testName;
+// Where the last failed assertion was, or NULL if none has failed
+static const char *assertionFile;
+static int assertionLine;
 
 void testAssert__(int assertion, const char *file, int line, const char *fstr1,
                   const char *fstr2, const char *fstr3, ...)
@@ -55,6 +80,8 @@ void testAssert__(int assertion, const char *file, int line, const char *fstr1,
     {
         printf("Assertion failed in test \"%s\" on %s:%i\n", testName, file,
                line);
+        assertionFile = file;
+        assertionLine = line;
         char *format;
         if (asprintf(&format, "%s%s%s\n", fstr1, fstr2, fstr3) == -1)
         {
@@ -72,105 +99,1198 @@ void testAssert__(int assertion, const char *file, int line, const char *fstr1,
     }
 }
 
-void registerTest(const char *name, testFunc__ testFn, int expectedException)
+// The linker puts each file's descriptors together in the order the files
+// were linked, but within a file the compiler can put them in any order
+static int
+compareDeclarations(const void *a, const void *b)
 {
-    Test *test = malloc(sizeof(Test));
-    test->name = name;
-    test->test = testFn;
-    test->next = tests;
-    test->expectedException = expectedException;
-    tests = test;
+    const Test *x = *(const Test *const *)a;
+    const Test *y = *(const Test *const *)b;
+    return x->line - y->line;
 }
 
-void registerSetup(const char *name, testFunc__ setupFn, int expectedException)
+// Finds everything in one kind's section, in declaration order
+static void
+loadTests(TestList *list, const Test *start, const Test *stop)
 {
-    Test *setup = malloc(sizeof(Test));
-    setup->name = name;
-    setup->test = setupFn;
-    setup->next = setups;
-    setup->expectedException = expectedException;
-    setups = setup;
-}
+    list->count = start ? stop - start : 0;
+    list->items = malloc((list->count + 1) * sizeof(const Test *));
 
-void registerTeardown(const char *name, testFunc__ teardownFn, int expectedException)
-{
-    Test *teardown = malloc(sizeof(Test));
-    teardown->name = name;
-    teardown->test = teardownFn;
-    teardown->next = teardowns;
-    teardown->expectedException = expectedException;
-    teardowns = teardown;
+    int fileStart = 0;
+    for (int i = 0; i <= list->count; i++)
+    {
+        if (i == list->count || (i > 0 && strcmp(start[i].file,
+                                                 start[fileStart].file) != 0))
+        {
+            qsort(list->items + fileStart, i - fileStart, sizeof(const Test *),
+                  compareDeclarations);
+            fileStart = i;
+        }
+        if (i < list->count)
+        {
+            list->items[i] = &start[i];
+        }
+    }
 }
 
 static void
-cleanupTests(Test *tests)
+runAll(const TestList *tests)
 {
-    Test *test = tests;
-    while (test)
+    for (int i = 0; i < tests->count; i++)
     {
-        Test *nextTest = test->next;
-        free(test);
-        test = nextTest;
+        tests->items[i]->test();
     }
 }
 
-static void
-runAll(Test *tests)
+// How a single run of a test went
+enum
 {
-    Test *test = tests;
-    while (test)
-    {
-        test->test();
-        test = test->next;
-    }
+    TEST_PASSED,
+    // An assertion failed
+    TEST_FAILED,
+    // The wrong exception (or no exception) was thrown
+    TEST_ERROR,
+    // The test's process was killed by a signal
+    TEST_CRASHED,
+    TEST_TIMED_OUT,
+};
+
+static const char *const statusNames[] = {
+    [TEST_PASSED] = "passed",
+    [TEST_FAILED] = "failed",
+    [TEST_ERROR] = "error",
+    [TEST_CRASHED] = "crashed",
+    [TEST_TIMED_OUT] = "timed_out",
+};
+
+// Everything the reports need to know about a test run. This is filled in
+// by the process which ran the test, so it holds copies rather than pointers.
+typedef struct
+{
+    int status;
+    int expectedException;
+    int actualException;
+    char message[256];
+    // Where the assertion failed, or empty
+    char assertionFile[256];
+    int assertionLine;
+    double seconds;
+} TestResult;
+
+static double
+currentTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-static Exception
-runSafely(Test *test)
+// Returns the type of the exception which the test threw, or 0, copying its
+// message into message
+static int
+runSafely(const Test *test, char *message, size_t messageSize)
 {
+    volatile int type = 0;
+    snprintf(message, messageSize, "no exception thrown");
+
     TRY
     {
         printf("Running test %s\n", test->name);
         testName = test->name;
         test->test();
     }
-    CATCH_ALL(e) { RETURN(e); }
+    CATCH_ALL(e)
+    {
+        // A THROWF message is given back to the arena when this TRY ends
+        snprintf(message, messageSize, "%s", e.message ? e.message : "");
+        type = e.type;
+    }
     FINALLY { printf("Done\n"); }
 
-    return (Exception){.type = 0, .message = "no exception thrown"};
+    return type;
 }
 
-int main(void)
+// Runs a single test along with the setups and teardowns, returning whether
+// it passed
+static bool
+runTest(const Test *test, TestResult *result)
 {
-    int numTests = 0;
-    Test *test = tests;
+    assertionFile = NULL;
+    double start = currentTime();
+    runAll(&setups);
+    char message[sizeof(result->message)];
+    int exceptionType = runSafely(test, message, sizeof(message));
+
+    *result = (TestResult){
+        .status = TEST_PASSED,
+        .expectedException = test->expectedException,
+        .actualException = exceptionType,
+        .assertionLine = assertionLine,
+        .seconds = currentTime() - start,
+    };
+    memcpy(result->message, message, sizeof(message));
+    if (assertionFile)
+    {
+        snprintf(result->assertionFile, sizeof(result->assertionFile), "%s",
+                 assertionFile);
+    }
 
-    while (test)
+    if (exceptionType == ASSERTION_FAILED_EXCEPTION)
     {
-        runAll(setups);
-        Exception exception = runSafely(test);
+        printf("Assertion failed in test %s\n", test->name);
+        result->status = TEST_FAILED;
+        return false;
+    }
+    else if (test->expectedException != exceptionType)
+    {
+        printf("Unexpected exception thrown in test"
+               "\"%s\" of type %i with message \"%s\"\n",
+               test->name, exceptionType, message);
+        result->status = TEST_ERROR;
+        return false;
+    }
+
+    runAll(&teardowns);
+    result->seconds = currentTime() - start;
+    return true;
+}
 
-        if (exception.type == ASSERTION_FAILED_EXCEPTION)
+// Each record is built up in a buffer of our own rather than stdio, so that
+// tests which fork can't flush a copy of it as well, and is written out as
+// soon as its test finishes so that nothing is lost if the runner dies
+#define REPORT_BUFFER_SIZE 65536
+
+typedef struct
+{
+    int fd;
+    size_t length;
+    char buffer[REPORT_BUFFER_SIZE];
+} Report;
+
+static Report jsonReport = {.fd = -1};
+static Report junitReport = {.fd = -1};
+// Only this process finishes the reports, not any which it forks
+static pid_t reportingProcess;
+// The name of the JUnit test suite, which is the name of the program
+static const char *reportSuite;
+
+static void
+writeAll(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written < 0)
         {
-            printf("Assertion failed in test %s\n", test->name);
-            exit(1);
+            perror("Failed to write the test report");
+            return;
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+static void
+flushReport(Report *report)
+{
+    writeAll(report->fd, report->buffer, report->length);
+    report->length = 0;
+}
+
+static void
+reportWrite(Report *report, const char *data, size_t length)
+{
+    if (report->length + length > REPORT_BUFFER_SIZE)
+    {
+        flushReport(report);
+        if (length > REPORT_BUFFER_SIZE)
+        {
+            writeAll(report->fd, data, length);
+            return;
         }
-        else if (test->expectedException != exception.type)
+    }
+
+    memcpy(report->buffer + report->length, data, length);
+    report->length += length;
+}
+
+#define REPORT_LITERAL(report, literal) \
+    reportWrite(report, literal, sizeof(literal) - 1)
+
+__attribute__((format(printf, 2, 3))) static void
+reportPrintf(Report *report, const char *format, ...)
+{
+    char buffer[1024];
+    va_list va;
+    va_start(va, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, va);
+    va_end(va);
+
+    if (length > 0)
+    {
+        reportWrite(report, buffer,
+                    (size_t)length < sizeof(buffer) ? (size_t)length
+                                                    : sizeof(buffer) - 1);
+    }
+}
+
+// Writes string as the contents of a JSON string
+static void
+reportJsonString(Report *report, const char *string)
+{
+    for (const char *c = string; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
         {
-            printf("Unexpected exception thrown in test"
-                   "\"%s\" of type %i with message \"%s\"\n",
-                   test->name, exception.type, exception.message);
-            exit(1);
+            char escaped[2] = {'\\', *c};
+            reportWrite(report, escaped, 2);
+        }
+        else if ((unsigned char)*c < 0x20)
+        {
+            reportPrintf(report, "\\u%04x", *c);
+        }
+        else
+        {
+            reportWrite(report, c, 1);
+        }
+    }
+}
+
+// Writes string as XML character data, which works for attributes too
+static void
+reportXmlString(Report *report, const char *string)
+{
+    for (const char *c = string; *c; c++)
+    {
+        switch (*c)
+        {
+        case '&':
+            REPORT_LITERAL(report, "&amp;");
+            break;
+        case '<':
+            REPORT_LITERAL(report, "&lt;");
+            break;
+        case '>':
+            REPORT_LITERAL(report, "&gt;");
+            break;
+        case '"':
+            REPORT_LITERAL(report, "&quot;");
+            break;
+        // As references, so that attributes keep them too
+        case '\n':
+            REPORT_LITERAL(report, "&#10;");
+            break;
+        case '\t':
+            REPORT_LITERAL(report, "&#9;");
+            break;
+        default:
+            // Other control characters aren't allowed in XML at all
+            if ((unsigned char)*c >= 0x20)
+            {
+                reportWrite(report, c, 1);
+            }
         }
+    }
+}
+
+static void
+reportJson(Report *report, const char *name, const TestResult *result)
+{
+    REPORT_LITERAL(report, "{\"name\":\"");
+    reportJsonString(report, name);
+    reportPrintf(report,
+                 "\",\"status\":\"%s\",\"expected_type\":%d,"
+                 "\"actual_type\":%d,\"message\":\"",
+                 statusNames[result->status], result->expectedException,
+                 result->actualException);
+    reportJsonString(report, result->message);
+    REPORT_LITERAL(report, "\",\"file\":");
+    if (result->assertionFile[0])
+    {
+        REPORT_LITERAL(report, "\"");
+        reportJsonString(report, result->assertionFile);
+        reportPrintf(report, "\",\"line\":%d", result->assertionLine);
+    }
+    else
+    {
+        REPORT_LITERAL(report, "null,\"line\":null");
+    }
+    reportPrintf(report, ",\"duration\":%.6f}\n", result->seconds);
+}
+
+static void
+reportJunit(Report *report, const char *name, const TestResult *result)
+{
+    REPORT_LITERAL(report, "    <testcase classname=\"");
+    reportXmlString(report, reportSuite);
+    REPORT_LITERAL(report, "\" name=\"");
+    reportXmlString(report, name);
+    reportPrintf(report, "\" time=\"%.6f\"", result->seconds);
 
-        runAll(teardowns);
-        test = test->next;
-        numTests++;
+    const char *element;
+    switch (result->status)
+    {
+    case TEST_PASSED:
+        REPORT_LITERAL(report, "/>\n");
+        return;
+    case TEST_FAILED:
+        element = "failure";
+        break;
+    default:
+        element = "error";
     }
 
-    cleanupTests(tests);
-    cleanupTests(setups);
-    cleanupTests(teardowns);
+    reportPrintf(report, ">\n      <%s type=\"%s\" message=\"", element,
+                 statusNames[result->status]);
+    reportXmlString(report, result->message);
+    REPORT_LITERAL(report, "\">");
+    if (result->status == TEST_ERROR)
+    {
+        reportPrintf(report, "Expected exception type %d, got %d",
+                     result->expectedException, result->actualException);
+    }
+    else if (result->assertionFile[0])
+    {
+        reportXmlString(report, result->assertionFile);
+        reportPrintf(report, ":%d", result->assertionLine);
+    }
+    else
+    {
+        reportXmlString(report, result->message);
+    }
+    reportPrintf(report, "</%s>\n    </testcase>\n", element);
+}
+
+static void
+reportResult(const Test *test, const TestResult *result)
+{
+    if (jsonReport.fd >= 0)
+    {
+        reportJson(&jsonReport, test->name, result);
+        flushReport(&jsonReport);
+    }
+    if (junitReport.fd >= 0)
+    {
+        reportJunit(&junitReport, test->name, result);
+        flushReport(&junitReport);
+    }
+}
+
+static void
+finishReports(void)
+{
+    if (getpid() != reportingProcess)
+    {
+        return;
+    }
+
+    if (junitReport.fd >= 0)
+    {
+        reportPrintf(&junitReport, "  </testsuite>\n</testsuites>\n");
+        flushReport(&junitReport);
+    }
+}
+
+static void
+openReport(Report *report, const char *fileName)
+{
+    report->fd = strcmp(fileName, "-") == 0
+                     ? STDOUT_FILENO
+                     : open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (report->fd < 0)
+    {
+        perror(fileName);
+        exit(2);
+    }
+}
+
+// Opens the reports which were asked for. They are finished when the process
+// exits, however it exits.
+static void
+startReports(const char *jsonFile, const char *junitFile, const char *suite)
+{
+    reportingProcess = getpid();
+    reportSuite = suite;
+    if (jsonFile)
+    {
+        openReport(&jsonReport, jsonFile);
+    }
+    if (junitFile)
+    {
+        openReport(&junitReport, junitFile);
+        REPORT_LITERAL(&junitReport, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                    "<testsuites>\n  <testsuite name=\"");
+        reportXmlString(&junitReport, suite);
+        REPORT_LITERAL(&junitReport, "\">\n");
+        flushReport(&junitReport);
+    }
+    atexit(finishReports);
+}
+
+// Runs the tests in this process, stopping at the first failure
+static int
+runSerially(const Test **selected, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        TestResult result;
+        bool passed = runTest(selected[i], &result);
+        reportResult(selected[i], &result);
+        if (!passed)
+        {
+            exit(1);
+        }
+    }
 
     return 0;
 }
+
+// How long each test can run for with -j before it is killed, in seconds
+#define DEFAULT_TIMEOUT 60
+
+// A forked process running a single test, with everything it writes to
+// stdout and stderr coming back through a pipe
+typedef struct
+{
+    const Test *test;
+    pid_t pid;
+    int output;
+    double start;
+    double deadline;
+    bool timedOut;
+    // Shared with the worker's process, which fills it in
+    TestResult *result;
+    char *log;
+    size_t logSize;
+    FILE *logFile;
+} Worker;
+
+static void
+startWorker(Worker *worker, const Test *test, double timeout, TestResult *result)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        perror("pipe");
+        exit(1);
+    }
+
+    // Otherwise anything still buffered is written by the child as well
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0)
+    {
+        // In its own process group, so that anything it forks is killed
+        // along with it if it times out
+        setpgid(0, 0);
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[1]);
+        // Keep as much output as possible if the test crashes
+        setvbuf(stdout, NULL, _IOLBF, 0);
+
+        exit(runTest(test, result) ? 0 : 1);
+    }
+
+    setpgid(pid, pid);
+    close(fds[1]);
+
+    double start = currentTime();
+    *worker = (Worker){
+        .test = test,
+        .pid = pid,
+        .output = fds[0],
+        .start = start,
+        .deadline = timeout > 0 ? start + timeout : INFINITY,
+        .result = result,
+    };
+    worker->logFile = open_memstream(&worker->log, &worker->logSize);
+}
+
+// Reaps the worker once its output is closed, and reports how the test went.
+// Returns whether it passed.
+static bool
+finishWorker(Worker *worker, double timeout)
+{
+    close(worker->output);
+    int status;
+    waitpid(worker->pid, &status, 0);
+    fclose(worker->logFile);
+
+    // The result is only complete if the test got as far as finishing
+    TestResult *result = worker->result;
+    bool passed = false;
+    if (worker->timedOut)
+    {
+        printf("FAIL %s: timed out after %gs\n", worker->test->name, timeout);
+        *result = (TestResult){.status = TEST_TIMED_OUT,
+                               .seconds = currentTime() - worker->start};
+        snprintf(result->message, sizeof(result->message),
+                 "Timed out after %gs", timeout);
+    }
+    else if (WIFSIGNALED(status))
+    {
+        printf("FAIL %s: killed by signal %d (%s)\n", worker->test->name,
+               WTERMSIG(status), strsignal(WTERMSIG(status)));
+        *result = (TestResult){.status = TEST_CRASHED,
+                               .seconds = currentTime() - worker->start};
+        snprintf(result->message, sizeof(result->message),
+                 "Killed by signal %d (%s)", WTERMSIG(status),
+                 strsignal(WTERMSIG(status)));
+    }
+    else if (WEXITSTATUS(status) != 0)
+    {
+        printf("FAIL %s\n", worker->test->name);
+        if (result->status == TEST_PASSED)
+        {
+            // A teardown (or something else) exited early
+            result->status = TEST_FAILED;
+            result->seconds = currentTime() - worker->start;
+            snprintf(result->message, sizeof(result->message),
+                     "Exited with status %d", WEXITSTATUS(status));
+        }
+    }
+    else
+    {
+        printf("PASS %s\n", worker->test->name);
+        passed = true;
+    }
+
+    result->expectedException = worker->test->expectedException;
+    reportResult(worker->test, result);
+
+    // Only show the output of tests which need looking at
+    if (!passed)
+    {
+        fwrite(worker->log, 1, worker->logSize, stdout);
+    }
+
+    free(worker->log);
+    worker->test = NULL;
+    return passed;
+}
+
+// Runs each test in its own process, with up to jobs of them at once. Every
+// test runs however many fail, and the failures are listed at the end.
+static int
+runInParallel(const Test **selected, int numTests, int jobs, double timeout)
+{
+    Worker *workers = calloc(jobs, sizeof(Worker));
+    struct pollfd *fds = calloc(jobs, sizeof(struct pollfd));
+    // One result per worker, which its process writes to
+    TestResult *results = mmap(NULL, jobs * sizeof(TestResult),
+                               PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    const char **failed = calloc(numTests, sizeof(const char *));
+    int numFailed = 0;
+    int running = 0;
+    int next = 0;
+
+    while (next < numTests || running > 0)
+    {
+        for (int i = 0; i < jobs && next < numTests; i++)
+        {
+            if (!workers[i].test)
+            {
+                results[i] = (TestResult){.status = TEST_PASSED};
+                startWorker(&workers[i], selected[next++], timeout,
+                            &results[i]);
+                running++;
+            }
+        }
+
+        // Wait for some output, or until the next test times out
+        double earliestDeadline = INFINITY;
+        for (int i = 0; i < jobs; i++)
+        {
+            fds[i].fd = workers[i].test ? workers[i].output : -1;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+            if (workers[i].test && !workers[i].timedOut &&
+                workers[i].deadline < earliestDeadline)
+            {
+                earliestDeadline = workers[i].deadline;
+            }
+        }
+        int waitMs = -1;
+        if (earliestDeadline != INFINITY)
+        {
+            double remaining = earliestDeadline - currentTime();
+            waitMs = remaining > 0 ? (int)(remaining * 1000) + 1 : 0;
+        }
+        poll(fds, jobs, waitMs);
+
+        double now = currentTime();
+        for (int i = 0; i < jobs; i++)
+        {
+            Worker *worker = &workers[i];
+            if (!worker->test)
+            {
+                continue;
+            }
+
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                char buffer[4096];
+                ssize_t length = read(worker->output, buffer, sizeof(buffer));
+                if (length > 0)
+                {
+                    fwrite(buffer, 1, length, worker->logFile);
+                    continue;
+                }
+
+                const char *name = worker->test->name;
+                if (!finishWorker(worker, timeout))
+                {
+                    failed[numFailed++] = name;
+                }
+                running--;
+            }
+            else if (!worker->timedOut && now >= worker->deadline)
+            {
+                // Its output closes once it is dead, which finishes it
+                worker->timedOut = true;
+                kill(-worker->pid, SIGKILL);
+            }
+        }
+    }
+
+    printf("\n%d tests, %d passed, %d failed\n", numTests,
+           numTests - numFailed, numFailed);
+    for (int i = 0; i < numFailed; i++)
+    {
+        printf("  %s\n", failed[i]);
+    }
+
+    munmap(results, jobs * sizeof(TestResult));
+    free(failed);
+    free(fds);
+    free(workers);
+    return numFailed;
+}
+
+// Each benchmark is timed this many times, once its iteration count has been
+// calibrated so that a sample takes at least SAMPLE_NS
+#define BENCHMARK_SAMPLES 100
+#define SAMPLE_NS 1e6
+
+// How much slower than the baseline a benchmark can get, in percent
+#define DEFAULT_REGRESSION_THRESHOLD 10
+
+typedef struct
+{
+    char *name;
+    double medianNs;
+} BaselineResult;
+
+// Returns how long each iteration took on average, in nanoseconds
+static double
+timeIterations(testFunc__ benchmark, long iterations)
+{
+    double start = currentTime();
+    for (long i = 0; i < iterations; i++)
+    {
+        benchmark();
+    }
+
+    return (currentTime() - start) * 1e9 / iterations;
+}
+
+static int
+compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Writes name as a CSV field, since test names often contain commas
+static void
+printCsvString(const char *string)
+{
+    putchar('"');
+    for (const char *c = string; *c; c++)
+    {
+        if (*c == '"')
+        {
+            putchar('"');
+        }
+        putchar(*c);
+    }
+    putchar('"');
+}
+
+// Reads the quoted name at the start of a line written by printCsvString,
+// returning it and pointing rest at whatever follows it, or NULL if the
+// line doesn't start with one
+static char *
+parseCsvString(char *line, char **rest)
+{
+    if (*line != '"')
+    {
+        return NULL;
+    }
+
+    char *out = line;
+    for (char *c = line + 1; *c; c++)
+    {
+        if (*c == '"' && c[1] != '"')
+        {
+            *out = '\0';
+            *rest = c + 1;
+            return line;
+        }
+        *out++ = *c;
+        c += *c == '"';
+    }
+
+    return NULL;
+}
+
+// Loads the median of each benchmark from a previous run's output
+static BaselineResult *
+loadBaseline(const char *fileName, int *count)
+{
+    FILE *file = fopen(fileName, "r");
+    if (!file)
+    {
+        perror(fileName);
+        exit(2);
+    }
+
+    BaselineResult *results = NULL;
+    *count = 0;
+    char *line = NULL;
+    size_t lineSize = 0;
+    while (getline(&line, &lineSize, file) != -1)
+    {
+        char *rest;
+        char *name = parseCsvString(line, &rest);
+        long iterations;
+        double minNs, medianNs;
+        if (!name ||
+            sscanf(rest, ",%ld,%lf,%lf", &iterations, &minNs, &medianNs) != 3)
+        {
+            // The header, or something which isn't a result
+            continue;
+        }
+
+        results = realloc(results, (*count + 1) * sizeof(BaselineResult));
+        results[*count] = (BaselineResult){strdup(name), medianNs};
+        (*count)++;
+    }
+
+    free(line);
+    fclose(file);
+    return results;
+}
+
+static const BaselineResult *
+findBaseline(const BaselineResult *baseline, int count, const char *name)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (strcmp(baseline[i].name, name) == 0)
+        {
+            return &baseline[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void
+runBenchmark(const Test *benchmark, long *iterations, double *samples)
+{
+    runAll(&setups);
+    testName = benchmark->name;
+
+    TRY
+    {
+        // Keep doubling until a sample is long enough to measure, which
+        // also warms up the caches and branch predictors
+        *iterations = 1;
+        while (timeIterations(benchmark->test, *iterations) * *iterations <
+               SAMPLE_NS)
+        {
+            *iterations *= 2;
+        }
+
+        for (int i = 0; i < BENCHMARK_SAMPLES; i++)
+        {
+            samples[i] = timeIterations(benchmark->test, *iterations);
+        }
+    }
+    CATCH_ALL(e)
+    {
+        printf("Unexpected exception thrown in benchmark"
+               "\"%s\" of type %i with message \"%s\"\n",
+               benchmark->name, e.type, e.message);
+        exit(1);
+    }
+
+    runAll(&teardowns);
+    qsort(samples, BENCHMARK_SAMPLES, sizeof(double), compareDoubles);
+}
+
+// Runs every benchmark one at a time and prints the results. Returns how many
+// were more than threshold percent slower than the baseline, if there is one.
+static int
+runBenchmarks(const Test **selected, int count, const char *baselineFile,
+              double threshold)
+{
+    BaselineResult *baseline = NULL;
+    int baselineCount = 0;
+    if (baselineFile)
+    {
+        baseline = loadBaseline(baselineFile, &baselineCount);
+    }
+
+    printf("benchmark,iterations,min_ns,median_ns,p99_ns,ops_per_second%s\n",
+           baseline ? ",baseline_median_ns,change_percent" : "");
+
+    int regressions = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const Test *benchmark = selected[i];
+        long iterations;
+        double samples[BENCHMARK_SAMPLES];
+        runBenchmark(benchmark, &iterations, samples);
+
+        double median = samples[BENCHMARK_SAMPLES / 2];
+        printCsvString(benchmark->name);
+        printf(",%ld,%.2f,%.2f,%.2f,%.0f", iterations, samples[0], median,
+               samples[(BENCHMARK_SAMPLES - 1) * 99 / 100], 1e9 / median);
+
+        const BaselineResult *previous =
+            findBaseline(baseline, baselineCount, benchmark->name);
+        if (previous)
+        {
+            double change = (median / previous->medianNs - 1) * 100;
+            printf(",%.2f,%+.1f", previous->medianNs, change);
+            if (change > threshold)
+            {
+                regressions++;
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (regressions > 0)
+    {
+        printf("%d benchmarks regressed by more than %g%%\n", regressions,
+               threshold);
+    }
+
+    for (int i = 0; i < baselineCount; i++)
+    {
+        free(baseline[i].name);
+    }
+    free(baseline);
+    return regressions;
+}
+
+// splitmix64, so that a seed gives the same order on every platform
+static uint64_t
+nextRandom(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Which of the registered tests to run, and how
+typedef struct
+{
+    // Glob patterns, any of which a test's name must match. All tests run
+    // if there are none.
+    const char **filters;
+    int filterCount;
+    // Only run every shardCount'th test, starting from shardIndex
+    int shardIndex;
+    int shardCount;
+    bool shuffle;
+    uint64_t seed;
+    int repeat;
+} Selection;
+
+static bool
+matchesFilters(const Selection *selection, const char *name)
+{
+    if (selection->filterCount == 0)
+    {
+        return true;
+    }
+
+    for (int i = 0; i < selection->filterCount; i++)
+    {
+        if (fnmatch(selection->filters[i], name, 0) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Returns the tests to run in the order to run them, and how many there are
+static const Test **
+selectTests(const TestList *list, const Selection *selection, int *count)
+{
+    // Shard before shuffling, so that every machine splits the tests the
+    // same way whatever the seed
+    int matched = 0;
+    int selected = 0;
+    const Test **chosen = NULL;
+    for (int i = 0; i < list->count; i++)
+    {
+        const Test *test = list->items[i];
+        if (!matchesFilters(selection, test->name))
+        {
+            continue;
+        }
+        if (matched++ % selection->shardCount == selection->shardIndex)
+        {
+            chosen = realloc(chosen, (selected + 1) * sizeof(const Test *));
+            chosen[selected++] = test;
+        }
+    }
+
+    const Test **order =
+        malloc((selected * selection->repeat + 1) * sizeof(const Test *));
+    uint64_t random = selection->seed;
+    for (int run = 0; run < selection->repeat; run++)
+    {
+        const Test **thisRun = order + run * selected;
+        memcpy(thisRun, chosen, selected * sizeof(const Test *));
+
+        // Fisher-Yates, giving each repetition a different order
+        for (int i = selected - 1; selection->shuffle && i > 0; i--)
+        {
+            int j = nextRandom(&random) % (i + 1);
+            const Test *swap = thisRun[i];
+            thisRun[i] = thisRun[j];
+            thisRun[j] = swap;
+        }
+    }
+
+    free(chosen);
+    *count = selected * selection->repeat;
+    return order;
+}
+
+// Parses i/n for --shard
+static bool
+parseShard(const char *shard, Selection *selection)
+{
+    char extra;
+    return sscanf(shard, "%d/%d%c", &selection->shardIndex,
+                  &selection->shardCount, &extra) == 2 &&
+           selection->shardCount > 0 && selection->shardIndex >= 0 &&
+           selection->shardIndex < selection->shardCount;
+}
+
+static void
+usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [-j jobs] [-t timeout]\n"
+            "       %s [options] -b [-c baseline] [-r threshold]\n"
+            "  -j jobs       Run each test in its own process, jobs at a time,\n"
+            "                and carry on after failures\n"
+            "  -t timeout    With -j, kill tests which take longer than this\n"
+            "                many seconds (default %d, 0 for no limit)\n"
+            "  -b            Run the benchmarks instead of the tests\n"
+            "  -c baseline   Compare against the output of an earlier -b run\n"
+            "  -r threshold  Fail if a benchmark's median is more than this\n"
+            "                many percent slower than the baseline\n"
+            "                (default %d)\n"
+            "Options:\n"
+            "  --filter=glob  Only run tests whose name matches glob. Can be\n"
+            "                 given more than once to run several.\n"
+            "  --shard=i/n    Split the tests into n shards and only run\n"
+            "                 shard i (from 0 to n - 1)\n"
+            "  --order=declaration|random\n"
+            "                 Run the tests in the order they are declared\n"
+            "                 (the default) or shuffled\n"
+            "  --seed=seed    The seed for --order=random, which is printed\n"
+            "                 so that an order can be repeated\n"
+            "  --repeat=n     Run every test n times\n"
+            "  --json=file    Write a JSON object per test to file as each\n"
+            "                 one finishes (- for stdout)\n"
+            "  --junit=file   Write a JUnit XML report to file\n",
+            program, program, DEFAULT_TIMEOUT, DEFAULT_REGRESSION_THRESHOLD);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    loadTests(&tests, __start_test_Test, __stop_test_Test);
+    loadTests(&setups, __start_test_Setup, __stop_test_Setup);
+    loadTests(&teardowns, __start_test_Teardown, __stop_test_Teardown);
+    loadTests(&benchmarks, __start_test_Benchmark, __stop_test_Benchmark);
+
+    int jobs = 0;
+    double timeout = DEFAULT_TIMEOUT;
+    bool benchmark = false;
+    const char *baselineFile = NULL;
+    double threshold = DEFAULT_REGRESSION_THRESHOLD;
+    Selection selection = {.shardCount = 1, .repeat = 1};
+    bool seeded = false;
+    const char *jsonFile = NULL;
+    const char *junitFile = NULL;
+
+    enum
+    {
+        FILTER_OPTION = 256,
+        SHARD_OPTION,
+        ORDER_OPTION,
+        SEED_OPTION,
+        REPEAT_OPTION,
+        JSON_OPTION,
+        JUNIT_OPTION,
+    };
+    static const struct option longOptions[] = {
+        {"filter", required_argument, NULL, FILTER_OPTION},
+        {"shard", required_argument, NULL, SHARD_OPTION},
+        {"order", required_argument, NULL, ORDER_OPTION},
+        {"seed", required_argument, NULL, SEED_OPTION},
+        {"repeat", required_argument, NULL, REPEAT_OPTION},
+        {"json", required_argument, NULL, JSON_OPTION},
+        {"junit", required_argument, NULL, JUNIT_OPTION},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "j:t:bc:r:", longOptions,
+                                 NULL)) != -1)
+    {
+        switch (option)
+        {
+        case FILTER_OPTION:
+            selection.filters =
+                realloc(selection.filters,
+                        (selection.filterCount + 1) * sizeof(const char *));
+            selection.filters[selection.filterCount++] = optarg;
+            break;
+        case SHARD_OPTION:
+            if (!parseShard(optarg, &selection))
+            {
+                usage(argv[0]);
+            }
+            break;
+        case ORDER_OPTION:
+            if (strcmp(optarg, "random") == 0)
+            {
+                selection.shuffle = true;
+            }
+            else if (strcmp(optarg, "declaration") != 0)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case SEED_OPTION:
+            selection.seed = strtoull(optarg, NULL, 0);
+            seeded = true;
+            break;
+        case JSON_OPTION:
+            jsonFile = optarg;
+            break;
+        case JUNIT_OPTION:
+            junitFile = optarg;
+            break;
+        case REPEAT_OPTION:
+            selection.repeat = atoi(optarg);
+            if (selection.repeat < 1)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'b':
+            benchmark = true;
+            break;
+        case 'c':
+            baselineFile = optarg;
+            break;
+        case 'r':
+            threshold = atof(optarg);
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            timeout = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind < argc)
+    {
+        usage(argv[0]);
+    }
+
+    if (selection.shuffle)
+    {
+        if (!seeded)
+        {
+            selection.seed = (uint64_t)time(NULL) ^ (uint64_t)getpid();
+        }
+        // On stderr so that it doesn't end up in benchmark results
+        fprintf(stderr, "Shuffling with --seed=%llu\n",
+                (unsigned long long)selection.seed);
+    }
+
+    int count;
+    const Test **selected =
+        selectTests(benchmark ? &benchmarks : &tests, &selection, &count);
+
+    if (!benchmark)
+    {
+        const char *program = strrchr(argv[0], '/');
+        startReports(jsonFile, junitFile, program ? program + 1 : argv[0]);
+    }
+
+    int failures;
+    if (benchmark)
+    {
+        failures = runBenchmarks(selected, count, baselineFile, threshold);
+    }
+    else if (jobs > 0)
+    {
+        failures = runInParallel(selected, count, jobs, timeout);
+    }
+    else
+    {
+        failures = runSerially(selected, count);
+    }
+
+    free(selected);
+    free(selection.filters);
+
+    free(tests.items);
+    free(setups.items);
+    free(teardowns.items);
+    free(benchmarks.items);
+
+    return failures > 0 ? 1 : 0;
+}
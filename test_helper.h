@@ -28,9 +28,26 @@ typedef void (*testFunc__)(void);
 
 void testAssert__(int assertion, const char *file, int line, const char *fstr1,
                   const char *fstr2, const char *fstr3, ...);
-void registerTest(const char *name, testFunc__ test, int expectedException);
-void registerSetup(const char *name, testFunc__ test, int expectedException);
-void registerTeardown(const char *name, testFunc__ test, int expectedException);
+
+/*
+ * Each TEST, SETUP, TEARDOWN and BENCHMARK is a static descriptor placed in a
+ * linker section of its own kind (test_Test, test_Setup and so on), which the
+ * runner finds through the __start_ and __stop_ symbols the linker provides.
+ * Nothing runs or allocates at startup to register them.
+ *
+ * Every descriptor is 32 bytes and 32 byte aligned, which is the most the
+ * compiler will align an object of that size by itself, so that the section
+ * is a plain array with no padding between entries.
+ */
+typedef struct
+{
+    const char *name;
+    testFunc__ test;
+    // Where it was declared, so that the runner can keep declaration order
+    const char *file;
+    int line;
+    int expectedException;
+} __attribute__((aligned(32))) TestDescriptor__;
 
 #define TEST_ASSERT__(assertion, fstr1, fstr2, fstr3, ...)               \
     do                                                                   \
@@ -41,14 +58,12 @@ void registerTeardown(const char *name, testFunc__ test, int expectedException);
 
 #define TEST_CONCAT1__(a, b) a##b
 #define TEST_CONCAT__(a, b) TEST_CONCAT1__(a, b)
-#define TEST_REGISTER_TYPE__(name, prefix, exception)               \
-    static void TEST_CONCAT__(prefix##_, __LINE__)(void);           \
-    __attribute__((constructor)) static void TEST_CONCAT__(         \
-        register##prefix##_, __LINE__)(void)                        \
-    {                                                               \
-        register##prefix(name, &TEST_CONCAT__(prefix##_, __LINE__), \
-                         exception);                                \
-    }                                                               \
+#define TEST_REGISTER_TYPE__(name, prefix, exception)                    \
+    static void TEST_CONCAT__(prefix##_, __LINE__)(void);                \
+    __attribute__((used, section("test_" #prefix))) static const         \
+        TestDescriptor__ TEST_CONCAT__(prefix##Descriptor_, __LINE__) = { \
+            name, &TEST_CONCAT__(prefix##_, __LINE__), __FILE__,         \
+            __LINE__, exception};                                        \
     static void TEST_CONCAT__(prefix##_, __LINE__)()
 
 #define TEST_EXPECTING(name, exception) \
@@ -58,6 +73,17 @@ void registerTeardown(const char *name, testFunc__ test, int expectedException);
 #define SETUP() TEST_REGISTER_TYPE__("setup", Setup, 0)
 #define TEARDOWN() TEST_REGISTER_TYPE__("teardown", Teardown, 0)
 
+/*
+ * Benchmarks are only run when the tests are run with -b. The body is a
+ * single operation, which is called as many times as it takes to get a
+ * measurable sample. Results go to stdout as CSV, which can be saved and
+ * passed back in with -c to fail when a benchmark gets slower.
+ */
+#define BENCHMARK(name) TEST_REGISTER_TYPE__(name, Benchmark, 0)
+
+// Makes the compiler calculate value even though nothing uses it
+#define DO_NOT_OPTIMISE(value) __asm__ volatile("" : : "g"(value) : "memory")
+
 #define FORMAT_STRING__(thing)   \
     _Generic((thing),            \
              unsigned char       \
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2020 Gwilym Kuiper <gw@ilym.me>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Multi-threaded stress benchmark.
+ *
+ * Every thread repeatedly enters a TRY block, throws, catches and runs a
+ * FINALLY. Since the exception state is per thread, the total throughput
+ * should scale with the number of threads (up to the number of cores).
+ *
+ * Usage: threads_bench [max threads] [iterations per thread]
+ */
+
+#include "exceptions.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static long iterations = 1000000;
+
+static void
+throwSomething(int type)
+{
+    THROW(type, "benchmark exception");
+}
+
+static bool
+throwAndCatch(void)
+{
+    volatile bool caught = false;
+
+    TRY { throwSomething(OUT_OF_RANGE_EXCEPTION); }
+    CATCH(OUT_OF_RANGE_EXCEPTION) { caught = true; }
+    FINALLY {}
+
+    return caught;
+}
+
+static void *
+worker(void *arg)
+{
+    (void)arg;
+    long caught = 0;
+
+    for (long i = 0; i < iterations; i++)
+    {
+        caught += throwAndCatch();
+    }
+
+    if (caught != iterations)
+    {
+        fprintf(stderr, "Only caught %ld of %ld exceptions\n", caught,
+                iterations);
+        exit(1);
+    }
+
+    return NULL;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+runWithThreads(int numThreads)
+{
+    pthread_t threads[numThreads];
+
+    double start = now();
+    for (int i = 0; i < numThreads; i++)
+    {
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+        {
+            fprintf(stderr, "Failed to create thread %d\n", i);
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < numThreads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    return now() - start;
+}
+
+// Doubles the thread count each time, but always finishes with maxThreads
+static int
+nextThreadCount(int numThreads, int maxThreads)
+{
+    if (numThreads < maxThreads && numThreads * 2 > maxThreads)
+    {
+        return maxThreads;
+    }
+
+    return numThreads * 2;
+}
+
+int main(int argc, char **argv)
+{
+    long maxThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 1)
+    {
+        maxThreads = atol(argv[1]);
+    }
+    if (argc > 2)
+    {
+        iterations = atol(argv[2]);
+    }
+    if (maxThreads < 1)
+    {
+        maxThreads = 1;
+    }
+
+    printf("threads,seconds,throws_per_second,scaling\n");
+
+    double singleThreadRate = 0;
+    for (int numThreads = 1; numThreads <= maxThreads;
+         numThreads = nextThreadCount(numThreads, maxThreads))
+    {
+        double seconds = runWithThreads(numThreads);
+        double rate = numThreads * iterations / seconds;
+        if (numThreads == 1)
+        {
+            singleThreadRate = rate;
+        }
+
+        printf("%d,%f,%.0f,%.2f\n", numThreads, seconds, rate,
+               rate / singleThreadRate);
+    }
+
+    return 0;
+}